@@ -1,5 +1,7 @@
 #define USING_UI
 #define RENDER_ONE_IMAGE
+//#define BENCHMARK_BVH_BUILD
+//#define ANIMATE_INSTANCES
 
 #define _CRT_SECURE_NO_WARNINGS
 
@@ -23,6 +25,7 @@
 #include "object.hpp"
 #include "idiot_obj_parser.hpp"
 #include "bvh.hpp"
+#include "ray.hpp"
 
 #define FLOAT2RGB(x) std::round((x) * 255);
 
@@ -33,13 +36,7 @@ using namespace Math;
 
 v3 lightPosition = v3(0, 0, 0);
 
-u32 Random::state;
-
-std::atomic<r32> avgNodes = 0;
-std::atomic<r32> avgNodesCount = 0;
-
 int main() {
-    Random::state = time(NULL);
 #ifdef USING_UI
     SDL_Init(SDL_INIT_EVENTS);
 
@@ -62,6 +59,13 @@ int main() {
     Scene scene;
     scene.mPaths = new v3[width * height];
     scene.mIterations = 0;
+    scene.mSeed = 0;
+    // same image either way, only the throughput differs
+    scene.mWavefront = false;
+    // BVHBuilder::Morton builds in a fraction of the time, for scenes that get rebuilt often
+    scene.mBVHSettings.builder = BVHBuilder::BinnedSAH;
+    // mesh BVHs are written next to the executable and loaded instead of rebuilt on the next run
+    scene.mBVHSettings.cacheDirectory = ".";
 
     Texture kittyTexture("chess.png");
     Sphere* s1 = new Sphere(v3(3, 3, 5), 1);
@@ -136,33 +140,96 @@ int main() {
 #if 0
 #endif
 
-    TriangleArray* t0 = new TriangleArray(Import::OBJImporter::LoadFile("stanford_low_res.obj"));
+    Import::OBJMesh stanford = Import::OBJImporter::LoadMesh("stanford_low_res.obj");
+    TriangleArray* t0 = new TriangleArray(stanford.positions, stanford.indices);
     t0->SetRotation(m3::Rotate(75, v3::Axies::Y));
     t0->SetTranslate(v3(0, -1.2f, 4));
     t0->SetScale(m3::Scale(10, 10, 10));
     t0->PushTransforms();
     t0->ComputeBoundingBox();
+    t0->BuildBVH(scene.mBVHSettings);
+#ifdef BENCHMARK_BVH_BUILD
+    {
+        BVHBuildSettings settings;
+        settings.threadCount = 1;
+        BVH single = BVH::BuildFromMesh(t0, settings);
+        BVH parallel = BVH::BuildFromMesh(t0);
+        std::cout << "BVH build " << single.mBuildTime << "[ms] on 1 thread, "
+            << parallel.mBuildTime << "[ms] on " << std::thread::hardware_concurrency() << " threads, speedup "
+            << single.mBuildTime / parallel.mBuildTime << "x" << std::endl;
+
+        settings.threadCount = 0;
+        settings.builder = BVHBuilder::Morton;
+        BVH morton = BVH::BuildFromMesh(t0, settings);
+        std::cout << "Morton BVH build " << morton.mBuildTime << "[ms]" << std::endl;
+
+        // long thin triangles overlap a lot, spatial splits trade extra references for tighter nodes
+        settings.builder = BVHBuilder::SpatialSplits;
+        BVH spatial = BVH::BuildFromMesh(t0, settings);
+        std::cout << "SAH cost " << parallel.ComputeCost() << " binned, " << spatial.ComputeCost() << " with spatial splits in "
+            << spatial.mBuildTime << "[ms], "
+            << std::count_if(spatial.mPrimitiveIndices.begin(), spatial.mPrimitiveIndices.end(), [](u32 i) { return i != BVH::InvalidPrimitive; })
+            << " references for "
+            << t0->TriangleCount() << " triangles" << std::endl;
+
+        // quantized nodes, rays from the camera towards random points in the mesh bounds
+        settings.builder = BVHBuilder::BinnedSAH;
+        settings.compressNodes = true;
+        BVH compressed = BVH::BuildFromMesh(t0, settings);
+        // anyHit shoots shadow rays that end at the target instead
+        auto raysPerSecond = [&](const BVH& bvh, bool anyHit) {
+            const int rayCount = 1000000;
+            srand(1);
+            TraceStats stats;
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            for (int i = 0; i < rayCount; ++i) {
+                v3 target = t0->mBoundingBox.min + v3::Hadamard(t0->mBoundingBox.size,
+                    v3(rand() / (r32)RAND_MAX, rand() / (r32)RAND_MAX, rand() / (r32)RAND_MAX));
+                Ray ray;
+                ray.origin = v3(0, 0, 0);
+                ray.direction = target.Normalized();
+                if (anyHit) {
+                    ray.tMax = target.Length();
+                    bvh.Occluded(ray, stats);
+                    continue;
+                }
+                HitRecord hit;
+                bvh.Intersect(ray, hit, stats);
+            }
+            std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+            return rayCount / std::chrono::duration<r32>(end - start).count();
+        };
+        std::cout << "Wide nodes " << sizeof(BVH8Node) << " bytes each, " << parallel.mWideNodes.size() * sizeof(BVH8Node) / 1024 << "[KB], "
+            << raysPerSecond(parallel, false) / 1000000 << " Mrays/s, shadow rays " << raysPerSecond(parallel, true) / 1000000 << " Mrays/s" << std::endl;
+        std::cout << "Compressed nodes " << sizeof(BVH8CompressedNode) << " bytes each, " << compressed.mCompressedNodes.size() * sizeof(BVH8CompressedNode) / 1024 << "[KB], "
+            << raysPerSecond(compressed, false) / 1000000 << " Mrays/s, shadow rays " << raysPerSecond(compressed, true) / 1000000 << " Mrays/s" << std::endl;
+    }
+#endif
     t0->SetColor(v3(0.5f, 0.7f, 0.9f));
     t0->SetRoughness(0.7f);
     scene.AddObject(t0);
 #if 1
 
-    TriangleArray* t1 = new TriangleArray(Import::OBJImporter::LoadFile("monkey_low_res.obj"));
+    // loaded once, both instances share the triangles and the bottom level BVH
+    Import::OBJMesh monkeyMesh = Import::OBJImporter::LoadMesh("monkey_low_res.obj");
+    TriangleArray* monkey = new TriangleArray(monkeyMesh.positions, monkeyMesh.indices);
+    monkey->ComputeBoundingBox();
+    monkey->BuildBVH(scene.mBVHSettings);
+
+    MeshInstance* t1 = new MeshInstance(monkey);
     t1->SetRotation(m3::Rotate(-45, v3::Axies::Z));
     t1->SetTranslate(v3(1, -0.4f, 3));
     //t1->SetScale(m3::Scale(10, 10, 10));
     t1->PushTransforms();
-    t1->ComputeBoundingBox();
     t1->SetColor(v3(1, 0, 0));
     t1->SetEmission(v3(1, 0, 0));
     scene.AddObject(t1);
 
-    TriangleArray* t2 = new TriangleArray(Import::OBJImporter::LoadFile("monkey_low_res.obj"));
+    MeshInstance* t2 = new MeshInstance(monkey);
     t2->SetRotation(m3::Rotate(-55, v3::Axies::X) * m3::Rotate(85, v3::Axies::Y));
     t2->SetTranslate(v3(-1, -0.5f, 3.2f));
     //t1->SetScale(m3::Scale(10, 10, 10));
     t2->PushTransforms();
-    t2->ComputeBoundingBox();
     t2->SetColor(v3(0.8f, 0.9f, 0));
     t2->SetRoughness(0.9f);
     scene.AddObject(t2);
@@ -174,20 +241,16 @@ int main() {
     c0->SetRoughness(0.8f);
     scene.AddObject(c0);
 #endif
-    // TODO fix issues with the octree node positions/size
-    BVH bvh = BVH::BuildFromScene(&scene, 4);
+    BVH bvh = BVH::BuildFromScene(&scene);
     scene.bvh = &bvh;
 
     int threadCount = std::thread::hardware_concurrency();
     //int threadCount = 1;
 
     std::vector<ThreadContext> contextes;
-    int chunkSize = height / threadCount;
     for (int i = 0; i < threadCount; ++i) {
         ThreadContext c = {};
         c.id = i;
-        c.startY = chunkSize * i;
-        c.endY = c.startY + chunkSize;
         c.width = width;
         c.height = height;
         c.scene = &scene;
@@ -197,6 +260,9 @@ int main() {
     ThreadManager::CreateThreadPool(contextes);
 
     //r32 time = 0;
+#ifdef ANIMATE_INSTANCES
+    r32 angle = 85;
+#endif
 #if defined(RENDER_ONE_IMAGE) && defined(USING_UI)
     bool renderedOnce = false;
 #endif
@@ -223,12 +289,23 @@ int main() {
 #endif
                 std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
 
+#ifdef ANIMATE_INSTANCES
+                // moving an instance only refits the top level, accumulation starts over
+                t2->SetRotation(m3::Rotate(-55, v3::Axies::X) * m3::Rotate(angle, v3::Axies::Y));
+                angle += 5;
+                t2->PushTransforms();
+                bvh.MarkDirty(t2);
+                bvh.Update();
+                std::fill(scene.mPaths, scene.mPaths + width * height, v3());
+                scene.mIterations = 0;
+#endif
+
                 ++scene.mIterations;
                 ThreadManager::ResumeThreads();
                 ThreadManager::WaitForThreads();
 #if defined(RENDER_ONE_IMAGE) && defined(USING_UI)
                 ThreadManager::StopThreads();
-                std::cout << "Avarage number of nodes intersected/ray " << avgNodes / avgNodesCount << std::endl;
+                ThreadManager::FrameStats().Print(std::cout);
                 std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
                 std::cout << "Time it took " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "[ms]" << std::endl;
             }
@@ -253,6 +330,8 @@ int main() {
 #endif
 
     ThreadManager::StopThreads();
+    ThreadManager::TotalStats().Print(std::cout);
+    ThreadManager::PrintWakeupLatency();
 
 #ifdef USING_UI
     SDL_DestroyTexture(texture);
@@ -2,145 +2,1991 @@
 #include "scene.hpp"
 #include "ray.hpp"
 
+#include <immintrin.h>
+#include <thread>
+#include <chrono>
+#include <string>
+#include <cstring>
+
 using namespace Math;
-#define RENDER_DEBUG_SPHERES
-
-v3 defaultStartingPosition(0, 0, 3);
-v3 defaultStartingSize(20, 20, 20);
-int numberOfLeafs = 0;
-r32 offsetDivider = 4.0f;
-BVHNode* BVH::GenerateNode(std::vector<Object*>& objects, BVHNode* parent, v3 position, int currentDepth) {
-	if (currentDepth > mDepth) {
-		return nullptr;
-	}
-
-	bool isLeaf = currentDepth == mDepth;
-	BVHNode* node = new BVHNode(position, parent->size / 2.0f, parent);
-	node->isLeaf = isLeaf;
-
-	bool intersected = false;// SPONGE
-	std::vector<Triangle*> triangles;
-	for (auto& obj : objects) {
-		if (obj->IntersectsBox(node->position, node->size)) {
-			if (obj->mIsMesh) {
-				MeshObject* s = dynamic_cast<MeshObject*>(obj);
-				triangles = s->IntersectedTriangles(node->position, node->size);
-				if (triangles.size()) {
-					intersected = true;
-					if (isLeaf) {
-						auto* m = &(node->triangleContents[obj]);
-						m->insert(m->end(), triangles.begin(), triangles.end());
-					}
+//#define RENDER_DEBUG_SPHERES
+
+r32 traversalCost = 1.0f;
+r32 intersectionCost = 1.0f;
+
+struct SAHBin {
+	BoundingBox box = BoundingBox::Empty();
+	int count = 0;
+};
+
+struct BVH::BuildEntry {
+	BoundingBox box;
+	v3 centroid;
+	u32 index;
+};
+
+// per task output, subtrees built on other threads get spliced in behind their parent
+struct BVH::BuildContext {
+	std::vector<BVHNode> nodes;
+	std::vector<u32> order; // Morton only, sorted entry index for every leaf slot
+	int depth = 0;
+	int leafCount = 0;
+};
+
+// ranges smaller than these are not worth waking another core for
+static constexpr u32 ParallelSubtreeThreshold = 4096;
+static constexpr u32 ParallelBinningThreshold = 65536;
+
+// splits [start, end) into one chunk per thread, the last chunk runs on the calling thread
+template <typename F>
+static void ParallelFor(u32 start, u32 end, int threads, F f) {
+	u32 count = end - start;
+	u32 chunk = (count + threads - 1) / threads;
+	std::vector<std::thread> workers;
+	for (int i = 0; i < threads - 1; ++i) {
+		u32 chunkStart = start + chunk * i;
+		u32 chunkEnd = std::min(end, chunkStart + chunk);
+		workers.emplace_back(f, chunkStart, chunkEnd, i);
+	}
+	u32 lastStart = std::min(end, start + chunk * (threads - 1));
+	f(lastStart, end, threads - 1);
+	for (auto& w : workers) {
+		w.join();
+	}
+}
+
+u32 BVH::PrimitiveCount() const {
+	return mMesh ? mMesh->TriangleCount() : (u32)mPrimitives.size();
+}
+
+BoundingBox BVH::EntryBounds(u32 index) const {
+	BoundingBox box = BoundingBox::Empty();
+	if (mMesh) {
+		Triangle t = mMesh->GetTriangle(index);
+		box.Extend(t.A);
+		box.Extend(t.B);
+		box.Extend(t.C);
+	} else {
+		mPrimitives[index].object->GetBoundingBox(box);
+	}
+	return box;
+}
+
+u32 BVH::LeafTests(u32 count) const {
+#if defined(__AVX2__)
+	if (IsMeshBVH()) {
+		return (count + BlockSize - 1) / BlockSize;
+	}
+#endif
+	return count;
+}
+
+u32 BVH::GenerateNode(std::vector<BuildEntry>& entries, u32 start, u32 end, int currentDepth, int threads, BuildContext& context) {
+	u32 count = end - start;
+	int binningThreads = count >= ParallelBinningThreshold ? threads : 1;
+
+	BoundingBox box = BoundingBox::Empty();
+	BoundingBox centroidBox = BoundingBox::Empty();
+	{
+		std::vector<BoundingBox> boxes(binningThreads, BoundingBox::Empty());
+		std::vector<BoundingBox> centroidBoxes(binningThreads, BoundingBox::Empty());
+		ParallelFor(start, end, binningThreads, [&](u32 chunkStart, u32 chunkEnd, int chunk) {
+			for (u32 i = chunkStart; i < chunkEnd; ++i) {
+				boxes[chunk].Extend(entries[i].box);
+				centroidBoxes[chunk].Extend(entries[i].centroid);
+			}
+		});
+		for (int i = 0; i < binningThreads; ++i) {
+			box.Extend(boxes[i]);
+			centroidBox.Extend(centroidBoxes[i]);
+		}
+	}
+
+	u32 nodeIndex = (u32)context.nodes.size();
+	BVHNode node = {};
+	node.min = box.min;
+	node.max = box.max;
+	context.nodes.push_back(node);
+	context.depth = std::max(context.depth, currentDepth);
+
+	int bestAxis = -1;
+	int bestSplit = -1;
+	r32 bestCost = std::numeric_limits<r32>::max();
+
+	// binned SAH over the centroid bounds, every axis, BinCount - 1 candidate planes each
+	if (count > 1) {
+		// every chunk bins into its own copy, merged afterwards
+		std::vector<SAHBin> chunkBins(binningThreads * 3 * BinCount);
+		ParallelFor(start, end, binningThreads, [&](u32 chunkStart, u32 chunkEnd, int chunk) {
+			SAHBin* bins = &chunkBins[chunk * 3 * BinCount];
+			for (int axis = 0; axis < 3; ++axis) {
+				r32 extent = centroidBox.max[axis] - centroidBox.min[axis];
+				if (extent <= 0) {
+					continue;
+				}
+
+				r32 scale = BinCount / extent;
+				for (u32 i = chunkStart; i < chunkEnd; ++i) {
+					int b = std::max(0, std::min(BinCount - 1, (int)((entries[i].centroid[axis] - centroidBox.min[axis]) * scale)));
+					bins[axis * BinCount + b].box.Extend(entries[i].box);
+					++bins[axis * BinCount + b].count;
+				}
+			}
+		});
+
+		for (int axis = 0; axis < 3; ++axis) {
+			if (centroidBox.max[axis] - centroidBox.min[axis] <= 0) {
+				continue;
+			}
+
+			SAHBin bins[BinCount];
+			for (int chunk = 0; chunk < binningThreads; ++chunk) {
+				for (int i = 0; i < BinCount; ++i) {
+					const SAHBin& b = chunkBins[(chunk * 3 + axis) * BinCount + i];
+					bins[i].box.Extend(b.box);
+					bins[i].count += b.count;
+				}
+			}
+
+			r32 leftArea[BinCount - 1];
+			int leftCount[BinCount - 1];
+			BoundingBox leftBox = BoundingBox::Empty();
+			int leftSum = 0;
+			for (int i = 0; i < BinCount - 1; ++i) {
+				leftBox.Extend(bins[i].box);
+				leftSum += bins[i].count;
+				leftArea[i] = leftBox.SurfaceArea();
+				leftCount[i] = leftSum;
+			}
+
+			BoundingBox rightBox = BoundingBox::Empty();
+			int rightSum = 0;
+			for (int i = BinCount - 1; i > 0; --i) {
+				rightBox.Extend(bins[i].box);
+				rightSum += bins[i].count;
+				if (!leftCount[i - 1] || !rightSum) {
+					continue;
 				}
+
+				r32 cost = leftArea[i - 1] * LeafTests(leftCount[i - 1]) + rightBox.SurfaceArea() * LeafTests(rightSum);
+				if (cost < bestCost) {
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = i;
+				}
+			}
+		}
+	}
+
+	r32 area = box.SurfaceArea();
+	r32 leafCost = intersectionCost * LeafTests(count);
+	r32 splitCost = traversalCost + (area > 0 ? intersectionCost * bestCost / area : leafCost);
+
+	// the traversal stack is MaxDepth deep, so the deepest level has to hold whatever is left
+	bool isLeaf = count <= 1 || (count <= (u32)mSettings.maxLeafSize && leafCost <= splitCost) || currentDepth >= MaxDepth - 1;
+	if (isLeaf) {
+		context.nodes[nodeIndex].offset = start;
+		context.nodes[nodeIndex].count = count;
+		++context.leafCount;
+		return nodeIndex;
+	}
+
+	u32 middle = start;
+	if (bestAxis >= 0) {
+		r32 scale = BinCount / (centroidBox.max[bestAxis] - centroidBox.min[bestAxis]);
+		r32 minBound = centroidBox.min[bestAxis];
+		auto it = std::partition(entries.begin() + start, entries.begin() + end,
+			[&](const BuildEntry& e) {
+				int b = std::max(0, std::min(BinCount - 1, (int)((e.centroid[bestAxis] - minBound) * scale)));
+				return b < bestSplit;
+			});
+		middle = (u32)(it - entries.begin());
+	}
+
+	// all the centroids are stacked on top of each other, just halve the range
+	if (middle == start || middle == end) {
+		middle = start + count / 2;
+	}
+
+	if (threads > 1 && count >= ParallelSubtreeThreshold) {
+		// the second child goes to another thread, the first one has to follow the parent directly
+		BuildContext secondContext;
+		int secondThreads = threads / 2;
+		std::thread worker([&]() {
+			GenerateNode(entries, middle, end, currentDepth + 1, secondThreads, secondContext);
+		});
+		GenerateNode(entries, start, middle, currentDepth + 1, threads - secondThreads, context);
+		worker.join();
+
+		u32 second = (u32)context.nodes.size();
+		for (auto n : secondContext.nodes) {
+			if (!n.IsLeaf()) {
+				n.offset += second;
+			}
+			context.nodes.push_back(n);
+		}
+		context.depth = std::max(context.depth, secondContext.depth);
+		context.leafCount += secondContext.leafCount;
+		context.nodes[nodeIndex].offset = second;
+		return nodeIndex;
+	}
+
+	GenerateNode(entries, start, middle, currentDepth + 1, threads, context);
+	u32 second = GenerateNode(entries, middle, end, currentDepth + 1, threads, context);
+	context.nodes[nodeIndex].offset = second;
+
+	return nodeIndex;
+}
+
+// Morton / LBVH builder (Karras 2012), every internal node is emitted independently
+// from the sorted codes, then optionally restructured with small treelets (Karras & Aila 2013)
+
+static constexpr u32 MortonLeaf = 0x80000000;
+static constexpr int TreeletSize = 5;
+
+struct BVH::MortonNode {
+	BoundingBox box;
+	u32 children[2]; // MortonLeaf | sorted entry index for single primitives
+	u32 primitives;
+	r32 cost;
+};
+
+// spreads the low 10 bits so there are two zero bits between each of them
+static u32 ExpandBits(u32 v) {
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+static u32 MortonCode(const v3& p) {
+	u32 x = (u32)std::min(std::max(p.x * 1024.0f, 0.0f), 1023.0f);
+	u32 y = (u32)std::min(std::max(p.y * 1024.0f, 0.0f), 1023.0f);
+	u32 z = (u32)std::min(std::max(p.z * 1024.0f, 0.0f), 1023.0f);
+	return (ExpandBits(x) << 2) | (ExpandBits(y) << 1) | ExpandBits(z);
+}
+
+static int CountLeadingZeros(u32 v) {
+	if (!v) {
+		return 32;
+	}
+	int n = 0;
+	if (!(v & 0xFFFF0000u)) { n += 16; v <<= 16; }
+	if (!(v & 0xFF000000u)) { n += 8; v <<= 8; }
+	if (!(v & 0xF0000000u)) { n += 4; v <<= 4; }
+	if (!(v & 0xC0000000u)) { n += 2; v <<= 2; }
+	if (!(v & 0x80000000u)) { n += 1; }
+	return n;
+}
+
+// length of the common prefix of keys i and j, equal codes fall back to their indices
+static int CommonPrefix(const std::vector<u32>& codes, int i, int j) {
+	if (j < 0 || j >= (int)codes.size()) {
+		return -1;
+	}
+	if (codes[i] == codes[j]) {
+		return 32 + CountLeadingZeros((u32)(i ^ j));
+	}
+	return CountLeadingZeros(codes[i] ^ codes[j]);
+}
+
+// LSD radix sort of (code, index) pairs, 8 bits a pass, every chunk histograms and scatters its own range
+static void RadixSort(std::vector<u32>& codes, std::vector<u32>& indices, int threads) {
+	u32 count = (u32)codes.size();
+	std::vector<u32> tmpCodes(count);
+	std::vector<u32> tmpIndices(count);
+	std::vector<u32> histograms(threads * 256);
+
+	for (int shift = 0; shift < 32; shift += 8) {
+		std::fill(histograms.begin(), histograms.end(), 0);
+		ParallelFor(0, count, threads, [&](u32 chunkStart, u32 chunkEnd, int chunk) {
+			u32* h = &histograms[chunk * 256];
+			for (u32 i = chunkStart; i < chunkEnd; ++i) {
+				++h[(codes[i] >> shift) & 0xFF];
+			}
+		});
+
+		u32 sum = 0;
+		for (int digit = 0; digit < 256; ++digit) {
+			for (int chunk = 0; chunk < threads; ++chunk) {
+				u32 c = histograms[chunk * 256 + digit];
+				histograms[chunk * 256 + digit] = sum;
+				sum += c;
+			}
+		}
+
+		ParallelFor(0, count, threads, [&](u32 chunkStart, u32 chunkEnd, int chunk) {
+			u32* h = &histograms[chunk * 256];
+			for (u32 i = chunkStart; i < chunkEnd; ++i) {
+				u32 slot = h[(codes[i] >> shift) & 0xFF]++;
+				tmpCodes[slot] = codes[i];
+				tmpIndices[slot] = indices[i];
+			}
+		});
+
+		codes.swap(tmpCodes);
+		indices.swap(tmpIndices);
+	}
+}
+
+static void ComputeMortonBounds(std::vector<BVH::MortonNode>& nodes, const std::vector<BVH::BuildEntry>& sorted, u32 ref) {
+	BVH::MortonNode& node = nodes[ref];
+	node.box = BoundingBox::Empty();
+	node.primitives = 0;
+	node.cost = 0;
+	for (int i = 0; i < 2; ++i) {
+		u32 child = node.children[i];
+		if (child & MortonLeaf) {
+			const BoundingBox& b = sorted[child & ~MortonLeaf].box;
+			node.box.Extend(b);
+			node.primitives += 1;
+			node.cost += intersectionCost * b.SurfaceArea();
+		} else {
+			ComputeMortonBounds(nodes, sorted, child);
+			node.box.Extend(nodes[child].box);
+			node.primitives += nodes[child].primitives;
+			node.cost += nodes[child].cost;
+		}
+	}
+	node.cost += traversalCost * node.box.SurfaceArea();
+}
+
+// finds the cheapest topology for the treelet under ref and rewires its internal nodes
+static void RestructureTreelet(std::vector<BVH::MortonNode>& nodes, const std::vector<BVH::BuildEntry>& sorted, u32 ref) {
+	BVH::MortonNode& root = nodes[ref];
+
+	u32 leaves[TreeletSize];
+	u32 internals[TreeletSize - 1];
+	int leafCount = 0;
+	int internalCount = 0;
+	leaves[leafCount++] = root.children[0];
+	leaves[leafCount++] = root.children[1];
+	internals[internalCount++] = ref;
+
+	// open the largest internal treelet leaf until the treelet is full
+	while (leafCount < TreeletSize) {
+		int best = -1;
+		r32 bestArea = -1;
+		for (int i = 0; i < leafCount; ++i) {
+			if (leaves[i] & MortonLeaf) {
+				continue;
+			}
+			r32 area = nodes[leaves[i]].box.SurfaceArea();
+			if (area > bestArea) {
+				bestArea = area;
+				best = i;
+			}
+		}
+		if (best < 0) {
+			break;
+		}
+
+		u32 opened = leaves[best];
+		internals[internalCount++] = opened;
+		leaves[best] = nodes[opened].children[0];
+		leaves[leafCount++] = nodes[opened].children[1];
+	}
+
+	if (leafCount < 3) {
+		return;
+	}
+
+	const int subsetCount = 1 << leafCount;
+	BoundingBox boxes[1 << TreeletSize];
+	r32 costs[1 << TreeletSize];
+	u32 primitives[1 << TreeletSize];
+	int partitions[1 << TreeletSize];
+
+	for (int s = 1; s < subsetCount; ++s) {
+		boxes[s] = BoundingBox::Empty();
+		primitives[s] = 0;
+		for (int i = 0; i < leafCount; ++i) {
+			if (s & (1 << i)) {
+				u32 leaf = leaves[i];
+				if (leaf & MortonLeaf) {
+					boxes[s].Extend(sorted[leaf & ~MortonLeaf].box);
+					primitives[s] += 1;
+				} else {
+					boxes[s].Extend(nodes[leaf].box);
+					primitives[s] += nodes[leaf].primitives;
+				}
+			}
+		}
+
+		if (!(s & (s - 1))) {
+			int i = 0;
+			while (!(s & (1 << i))) {
+				++i;
+			}
+			u32 leaf = leaves[i];
+			costs[s] = (leaf & MortonLeaf) ? intersectionCost * boxes[s].SurfaceArea() : nodes[leaf].cost;
+			partitions[s] = 0;
+			continue;
+		}
+
+		// every split of s into two halves, the half holding the lowest bit is enumerated once
+		int lowest = s & -s;
+		r32 best = std::numeric_limits<r32>::max();
+		int bestPartition = 0;
+		for (int p = (s - 1) & s; p; p = (p - 1) & s) {
+			if (!(p & lowest)) {
+				continue;
+			}
+			r32 c = costs[p] + costs[s ^ p];
+			if (c < best) {
+				best = c;
+				bestPartition = p;
+			}
+		}
+		costs[s] = traversalCost * boxes[s].SurfaceArea() + best;
+		partitions[s] = bestPartition;
+	}
+
+	int full = subsetCount - 1;
+	if (costs[full] >= root.cost * 0.999f) {
+		return;
+	}
+
+	// hand out the internal nodes top down, the treelet root keeps its slot
+	int nextInternal = 1;
+	struct Pending {
+		u32 node;
+		int subset;
+	};
+	Pending pending[TreeletSize];
+	int pendingCount = 0;
+	pending[pendingCount++] = { ref, full };
+	while (pendingCount) {
+		Pending current = pending[--pendingCount];
+		int halves[2] = { partitions[current.subset], current.subset ^ partitions[current.subset] };
+
+		BVH::MortonNode& node = nodes[current.node];
+		node.box = boxes[current.subset];
+		node.primitives = primitives[current.subset];
+		node.cost = costs[current.subset];
+
+		for (int i = 0; i < 2; ++i) {
+			int half = halves[i];
+			if (!(half & (half - 1))) {
+				int leaf = 0;
+				while (!(half & (1 << leaf))) {
+					++leaf;
+				}
+				node.children[i] = leaves[leaf];
+			} else {
+				u32 internal = internals[nextInternal++];
+				node.children[i] = internal;
+				pending[pendingCount++] = { internal, half };
+			}
+		}
+	}
+}
+
+static void RestructureMortonNode(std::vector<BVH::MortonNode>& nodes, const std::vector<BVH::BuildEntry>& sorted, u32 ref, int maxLeafSize) {
+	BVH::MortonNode& node = nodes[ref];
+	// small subtrees get collapsed into a single leaf anyway
+	if (node.primitives <= (u32)maxLeafSize) {
+		return;
+	}
+
+	// the children got cheaper, refresh the cost the treelet has to beat
+	node.cost = traversalCost * node.box.SurfaceArea();
+	for (int i = 0; i < 2; ++i) {
+		u32 child = node.children[i];
+		if (child & MortonLeaf) {
+			node.cost += intersectionCost * sorted[child & ~MortonLeaf].box.SurfaceArea();
+		} else {
+			RestructureMortonNode(nodes, sorted, child, maxLeafSize);
+			node.cost += nodes[child].cost;
+		}
+	}
+	RestructureTreelet(nodes, sorted, ref);
+}
+
+static void GatherMortonLeaves(const std::vector<BVH::MortonNode>& nodes, u32 ref, std::vector<u32>& result) {
+	if (ref & MortonLeaf) {
+		result.push_back(ref & ~MortonLeaf);
+		return;
+	}
+	GatherMortonLeaves(nodes, nodes[ref].children[0], result);
+	GatherMortonLeaves(nodes, nodes[ref].children[1], result);
+}
+
+u32 BVH::FlattenMortonNode(std::vector<MortonNode>& mortonNodes, const std::vector<BuildEntry>& sorted, u32 ref, int currentDepth, BuildContext& context) {
+	u32 nodeIndex = (u32)context.nodes.size();
+	context.nodes.push_back({});
+	context.depth = std::max(context.depth, currentDepth);
+
+	bool isLeaf = (ref & MortonLeaf) || mortonNodes[ref].primitives <= (u32)mSettings.maxLeafSize || currentDepth >= MaxDepth - 1;
+	if (isLeaf) {
+		// the leaf order is rebuilt while flattening, restructuring breaks the sorted ranges
+		u32 offset = (u32)context.order.size();
+		GatherMortonLeaves(mortonNodes, ref, context.order);
+
+		BoundingBox box = BoundingBox::Empty();
+		BVHNode& node = context.nodes[nodeIndex];
+		node.offset = offset;
+		node.count = (u32)context.order.size() - offset;
+		for (u32 i = offset; i < offset + node.count; ++i) {
+			box.Extend(sorted[context.order[i]].box);
+		}
+		node.min = box.min;
+		node.max = box.max;
+		++context.leafCount;
+		return nodeIndex;
+	}
+
+	const MortonNode& mortonNode = mortonNodes[ref];
+	context.nodes[nodeIndex].min = mortonNode.box.min;
+	context.nodes[nodeIndex].max = mortonNode.box.max;
+	u32 children[2] = { mortonNode.children[0], mortonNode.children[1] };
+
+	FlattenMortonNode(mortonNodes, sorted, children[0], currentDepth + 1, context);
+	u32 second = FlattenMortonNode(mortonNodes, sorted, children[1], currentDepth + 1, context);
+	context.nodes[nodeIndex].offset = second;
+
+	return nodeIndex;
+}
+
+void BVH::BuildMorton(std::vector<BuildEntry>& entries, BuildContext& context) {
+	int threads = mSettings.threadCount;
+	u32 count = (u32)entries.size();
+
+	BoundingBox centroidBox = BoundingBox::Empty();
+	for (auto& e : entries) {
+		centroidBox.min = v3::Min(centroidBox.min, e.centroid);
+		centroidBox.max = v3::Max(centroidBox.max, e.centroid);
+	}
+	v3 extent = centroidBox.max - centroidBox.min;
+	v3 scale(extent.x > 0 ? 1.0f / extent.x : 0, extent.y > 0 ? 1.0f / extent.y : 0, extent.z > 0 ? 1.0f / extent.z : 0);
+
+	std::vector<u32> codes(count);
+	std::vector<u32> indices(count);
+	ParallelFor(0, count, threads, [&](u32 chunkStart, u32 chunkEnd, int /*chunk*/) {
+		for (u32 i = chunkStart; i < chunkEnd; ++i) {
+			codes[i] = MortonCode(v3::Hadamard(entries[i].centroid - centroidBox.min, scale));
+			indices[i] = i;
+		}
+	});
+
+	RadixSort(codes, indices, threads);
+
+	std::vector<BuildEntry> sorted(count);
+	ParallelFor(0, count, threads, [&](u32 chunkStart, u32 chunkEnd, int /*chunk*/) {
+		for (u32 i = chunkStart; i < chunkEnd; ++i) {
+			sorted[i] = entries[indices[i]];
+		}
+	});
+
+	if (count == 1) {
+		BVHNode node = {};
+		node.min = sorted[0].box.min;
+		node.max = sorted[0].box.max;
+		node.count = 1;
+		context.nodes.push_back(node);
+		context.leafCount = 1;
+		return;
+	}
+
+	// count - 1 internal nodes, each one finds its own range and split
+	std::vector<MortonNode> mortonNodes(count - 1);
+	ParallelFor(0, count - 1, threads, [&](u32 chunkStart, u32 chunkEnd, int /*chunk*/) {
+		for (u32 n = chunkStart; n < chunkEnd; ++n) {
+			int i = (int)n;
+			int d = CommonPrefix(codes, i, i + 1) - CommonPrefix(codes, i, i - 1) >= 0 ? 1 : -1;
+			int minPrefix = CommonPrefix(codes, i, i - d);
+
+			int maxLength = 2;
+			while (CommonPrefix(codes, i, i + maxLength * d) > minPrefix) {
+				maxLength *= 2;
+			}
+			int length = 0;
+			for (int t = maxLength / 2; t >= 1; t /= 2) {
+				if (CommonPrefix(codes, i, i + (length + t) * d) > minPrefix) {
+					length += t;
+				}
+			}
+			int j = i + length * d;
+
+			int nodePrefix = CommonPrefix(codes, i, j);
+			int split = 0;
+			for (int t = (length + 1) / 2; ; t = (t + 1) / 2) {
+				if (CommonPrefix(codes, i, i + (split + t) * d) > nodePrefix) {
+					split += t;
+				}
+				if (t == 1) {
+					break;
+				}
+			}
+			int gamma = i + split * d + std::min(d, 0);
+
+			MortonNode& node = mortonNodes[n];
+			node.children[0] = std::min(i, j) == gamma ? (MortonLeaf | gamma) : (u32)gamma;
+			node.children[1] = std::max(i, j) == gamma + 1 ? (MortonLeaf | (gamma + 1)) : (u32)(gamma + 1);
+		}
+	});
+
+	ComputeMortonBounds(mortonNodes, sorted, 0);
+	if (mSettings.restructure) {
+		RestructureMortonNode(mortonNodes, sorted, 0, mSettings.maxLeafSize);
+	}
+
+	context.order.reserve(count);
+	FlattenMortonNode(mortonNodes, sorted, 0, 0, context);
+
+	ParallelFor(0, count, threads, [&](u32 chunkStart, u32 chunkEnd, int /*chunk*/) {
+		for (u32 i = chunkStart; i < chunkEnd; ++i) {
+			entries[i] = sorted[context.order[i]];
+		}
+	});
+}
+
+// spatial split builder (Stich et al. 2009), references straddling a split plane are clipped
+// and go to both children as long as the budget of extra references lasts
+
+// spatial splits are only tried where the object split children overlap by more than this much of the root
+static constexpr r32 SpatialSplitAlpha = 1e-5f;
+
+static bool IsValid(const BoundingBox& box) {
+	return box.min.x <= box.max.x && box.min.y <= box.max.y && box.min.z <= box.max.z;
+}
+
+// bounds of the part of a triangle inside bounds, clipped one plane at a time
+static BoundingBox ClipTriangle(const Triangle& t, const BoundingBox& bounds) {
+	BoundingBox result = BoundingBox::Empty();
+
+	// every plane adds at most one vertex
+	v3 polygon[2][9];
+	v3* in = polygon[0];
+	v3* out = polygon[1];
+	int count = 3;
+	in[0] = t.A;
+	in[1] = t.B;
+	in[2] = t.C;
+	for (int axis = 0; axis < 3; ++axis) {
+		for (int side = 0; side < 2; ++side) {
+			r32 plane = side ? bounds.max[axis] : bounds.min[axis];
+			int outCount = 0;
+			for (int i = 0; i < count; ++i) {
+				const v3& a = in[i];
+				const v3& b = in[(i + 1) % count];
+				// positive inside
+				r32 da = side ? plane - a[axis] : a[axis] - plane;
+				r32 db = side ? plane - b[axis] : b[axis] - plane;
+				if (da >= 0) {
+					out[outCount++] = a;
+				}
+				if ((da < 0) != (db < 0)) {
+					v3 p = a + (b - a) * (da / (da - db));
+					p[axis] = plane;
+					out[outCount++] = p;
+				}
+			}
+			std::swap(in, out);
+			count = outCount;
+			if (!count) {
+				return result;
+			}
+		}
+	}
+
+	for (int i = 0; i < count; ++i) {
+		result.Extend(in[i]);
+	}
+	// rounding can push the intersections a little outside
+	return BoundingBox(v3::Max(result.min, bounds.min), v3::Min(result.max, bounds.max));
+}
+
+BoundingBox BVH::ClipEntry(u32 index, const BoundingBox& bounds) const {
+	if (mMesh) {
+		return ClipTriangle(mMesh->GetTriangle(index), bounds);
+	}
+	BoundingBox box = EntryBounds(index);
+	return BoundingBox(v3::Max(box.min, bounds.min), v3::Min(box.max, bounds.max));
+}
+
+u32 BVH::GenerateSpatialNode(std::vector<BuildEntry>& refs, int currentDepth, r32 rootArea, u32& budget, std::vector<BuildEntry>& leafRefs, BuildContext& context) {
+	u32 count = (u32)refs.size();
+
+	BoundingBox box = BoundingBox::Empty();
+	BoundingBox centroidBox = BoundingBox::Empty();
+	for (auto& r : refs) {
+		box.Extend(r.box);
+		centroidBox.Extend(r.centroid);
+	}
+
+	u32 nodeIndex = (u32)context.nodes.size();
+	BVHNode node = {};
+	node.min = box.min;
+	node.max = box.max;
+	context.nodes.push_back(node);
+	context.depth = std::max(context.depth, currentDepth);
+
+	// object split, the same binned SAH GenerateNode uses
+	int objectAxis = -1;
+	int objectSplit = -1;
+	r32 objectCost = std::numeric_limits<r32>::max();
+	BoundingBox objectLeft = BoundingBox::Empty();
+	BoundingBox objectRight = BoundingBox::Empty();
+	for (int axis = 0; axis < 3 && count > 1; ++axis) {
+		r32 extent = centroidBox.max[axis] - centroidBox.min[axis];
+		if (extent <= 0) {
+			continue;
+		}
+
+		SAHBin bins[BinCount];
+		r32 scale = BinCount / extent;
+		for (auto& r : refs) {
+			int b = std::max(0, std::min(BinCount - 1, (int)((r.centroid[axis] - centroidBox.min[axis]) * scale)));
+			bins[b].box.Extend(r.box);
+			++bins[b].count;
+		}
+
+		BoundingBox leftBoxes[BinCount - 1];
+		int leftCount[BinCount - 1];
+		BoundingBox leftBox = BoundingBox::Empty();
+		int leftSum = 0;
+		for (int i = 0; i < BinCount - 1; ++i) {
+			leftBox.Extend(bins[i].box);
+			leftSum += bins[i].count;
+			leftBoxes[i] = leftBox;
+			leftCount[i] = leftSum;
+		}
+
+		BoundingBox rightBox = BoundingBox::Empty();
+		int rightSum = 0;
+		for (int i = BinCount - 1; i > 0; --i) {
+			rightBox.Extend(bins[i].box);
+			rightSum += bins[i].count;
+			if (!leftCount[i - 1] || !rightSum) {
+				continue;
+			}
+
+			r32 cost = leftBoxes[i - 1].SurfaceArea() * LeafTests(leftCount[i - 1]) + rightBox.SurfaceArea() * LeafTests(rightSum);
+			if (cost < objectCost) {
+				objectCost = cost;
+				objectAxis = axis;
+				objectSplit = i;
+				objectLeft = leftBoxes[i - 1];
+				objectRight = rightBox;
+			}
+		}
+	}
+
+	// spatial split, bins over the node bounds, every reference is clipped into each bin it touches
+	int spatialAxis = -1;
+	int spatialSplit = -1;
+	r32 spatialCost = std::numeric_limits<r32>::max();
+	BoundingBox overlap(v3::Max(objectLeft.min, objectRight.min), v3::Min(objectLeft.max, objectRight.max));
+	bool trySpatial = count > 1 && budget > 0 && (objectAxis < 0 || overlap.SurfaceArea() > SpatialSplitAlpha * rootArea);
+	for (int axis = 0; axis < 3 && trySpatial; ++axis) {
+		r32 extent = box.max[axis] - box.min[axis];
+		if (extent <= 0) {
+			continue;
+		}
+
+		r32 binSize = extent / BinCount;
+		BoundingBox binBoxes[BinCount];
+		int entering[BinCount] = {};
+		int exiting[BinCount] = {};
+		for (int i = 0; i < BinCount; ++i) {
+			binBoxes[i] = BoundingBox::Empty();
+		}
+
+		for (auto& r : refs) {
+			int first = std::max(0, std::min(BinCount - 1, (int)((r.box.min[axis] - box.min[axis]) / binSize)));
+			int last = std::max(first, std::min(BinCount - 1, (int)((r.box.max[axis] - box.min[axis]) / binSize)));
+			++entering[first];
+			++exiting[last];
+			if (first == last) {
+				binBoxes[first].Extend(r.box);
+				continue;
+			}
+
+			for (int b = first; b <= last; ++b) {
+				BoundingBox slab = r.box;
+				slab.min[axis] = std::max(slab.min[axis], box.min[axis] + binSize * b);
+				if (b < BinCount - 1) {
+					slab.max[axis] = std::min(slab.max[axis], box.min[axis] + binSize * (b + 1));
+				}
+				binBoxes[b].Extend(ClipEntry(r.index, slab));
+			}
+		}
+
+		BoundingBox leftBoxes[BinCount - 1];
+		int leftCount[BinCount - 1];
+		BoundingBox leftBox = BoundingBox::Empty();
+		int leftSum = 0;
+		for (int i = 0; i < BinCount - 1; ++i) {
+			leftBox.Extend(binBoxes[i]);
+			leftSum += entering[i];
+			leftBoxes[i] = leftBox;
+			leftCount[i] = leftSum;
+		}
+
+		BoundingBox rightBox = BoundingBox::Empty();
+		int rightSum = 0;
+		for (int i = BinCount - 1; i > 0; --i) {
+			rightBox.Extend(binBoxes[i]);
+			rightSum += exiting[i];
+			if (!leftCount[i - 1] || !rightSum) {
+				continue;
+			}
+
+			r32 cost = leftBoxes[i - 1].SurfaceArea() * LeafTests(leftCount[i - 1]) + rightBox.SurfaceArea() * LeafTests(rightSum);
+			if (cost < spatialCost) {
+				spatialCost = cost;
+				spatialAxis = axis;
+				spatialSplit = i;
+			}
+		}
+	}
+
+	r32 area = box.SurfaceArea();
+	r32 bestCost = std::min(objectCost, spatialCost);
+	r32 leafCost = intersectionCost * LeafTests(count);
+	r32 splitCost = traversalCost + (area > 0 ? intersectionCost * bestCost / area : leafCost);
+
+	bool isLeaf = count <= 1 || (count <= (u32)mSettings.maxLeafSize && leafCost <= splitCost) || currentDepth >= MaxDepth - 1;
+	if (isLeaf) {
+		context.nodes[nodeIndex].offset = (u32)leafRefs.size();
+		context.nodes[nodeIndex].count = count;
+		leafRefs.insert(leafRefs.end(), refs.begin(), refs.end());
+		++context.leafCount;
+		return nodeIndex;
+	}
+
+	std::vector<BuildEntry> left;
+	std::vector<BuildEntry> right;
+	if (spatialCost < objectCost) {
+		int axis = spatialAxis;
+		r32 plane = box.min[axis] + (box.max[axis] - box.min[axis]) * spatialSplit / BinCount;
+		for (auto& r : refs) {
+			if (r.box.max[axis] <= plane) {
+				left.push_back(r);
+				continue;
+			}
+			if (r.box.min[axis] >= plane) {
+				right.push_back(r);
+				continue;
+			}
+
+			BoundingBox leftBox = r.box;
+			BoundingBox rightBox = r.box;
+			leftBox.max[axis] = plane;
+			rightBox.min[axis] = plane;
+			leftBox = ClipEntry(r.index, leftBox);
+			rightBox = ClipEntry(r.index, rightBox);
+			bool hasLeft = IsValid(leftBox);
+			bool hasRight = IsValid(rightBox);
+			if (hasLeft && hasRight && budget > 0) {
+				left.push_back({ leftBox, leftBox.position, r.index });
+				right.push_back({ rightBox, rightBox.position, r.index });
+				--budget;
+			} else if (hasLeft != hasRight) {
+				BoundingBox& clipped = hasLeft ? leftBox : rightBox;
+				(hasLeft ? left : right).push_back({ clipped, clipped.position, r.index });
+			} else {
+				// out of budget, the whole reference goes where its centroid is
+				(r.centroid[axis] < plane ? left : right).push_back(r);
+			}
+		}
+	} else if (objectAxis >= 0) {
+		r32 scale = BinCount / (centroidBox.max[objectAxis] - centroidBox.min[objectAxis]);
+		for (auto& r : refs) {
+			int b = std::max(0, std::min(BinCount - 1, (int)((r.centroid[objectAxis] - centroidBox.min[objectAxis]) * scale)));
+			(b < objectSplit ? left : right).push_back(r);
+		}
+	}
+
+	// all the centroids are stacked on top of each other, just halve the range
+	if (left.empty() || right.empty()) {
+		left.assign(refs.begin(), refs.begin() + count / 2);
+		right.assign(refs.begin() + count / 2, refs.end());
+	}
+
+	// the children hold their own copies now, no need to keep this level around while they recurse
+	std::vector<BuildEntry>().swap(refs);
+
+	GenerateSpatialNode(left, currentDepth + 1, rootArea, budget, leafRefs, context);
+	u32 second = GenerateSpatialNode(right, currentDepth + 1, rootArea, budget, leafRefs, context);
+	context.nodes[nodeIndex].offset = second;
+
+	return nodeIndex;
+}
+
+void BVH::BuildSpatial(std::vector<BuildEntry>& entries, BuildContext& context) {
+	u32 budget = (u32)(entries.size() * mSettings.splitBudget);
+
+	BoundingBox root = BoundingBox::Empty();
+	for (auto& e : entries) {
+		root.Extend(e.box);
+	}
+
+	std::vector<BuildEntry> refs = entries;
+	std::vector<BuildEntry> leafRefs;
+	leafRefs.reserve(entries.size() + budget);
+	GenerateSpatialNode(refs, 0, root.SurfaceArea(), budget, leafRefs, context);
+
+	// the caller reads the leaf order back from entries, split references included
+	entries.swap(leafRefs);
+}
+
+void BVH::AddDebugSpheres(u32 nodeIndex, int currentDepth) {
+	const BVHNode& node = mNodes[nodeIndex];
+
+	Sphere* s1 = new Sphere((node.min + node.max) / 2, 0.1f);
+	if (nodeIndex == 0) {
+		s1->SetColor(v3(0, 1, 0));
+	} else if (node.IsLeaf()) {
+		s1->SetColor(v3(0, 0, 1));
+	} else {
+		r32 p = ((r32)currentDepth / (r32)mDepth) * 0.5f;
+		s1->SetColor(v3(1, 0, 0) * p);
+	}
+	s1->SetRoughness(1);
+	mScene->AddObject(s1);
+	mScene->mDebugObjects.push_back(s1);
+	// the walk only reads mNodes, the Rebuild after it puts the spheres into leaves
+	mPrimitives.push_back({ s1, mSpheres.Add(s1), PrimitiveType::Sphere });
+
+	if (!node.IsLeaf()) {
+		AddDebugSpheres(nodeIndex + 1, currentDepth + 1);
+		AddDebugSpheres(node.offset, currentDepth + 1);
+	}
+}
+
+void BVH::Build(std::vector<BuildEntry>& entries) {
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	if (mSettings.threadCount <= 0) {
+		mSettings.threadCount = std::max(1, (int)std::thread::hardware_concurrency());
+	}
+
+	// the refit links belong to the old topology
+	mParents.clear();
+	mPrimitiveLeafStart.clear();
+	mPrimitiveLeaves.clear();
+	mDirtyPrimitives.clear();
+	mAllDirty = false;
+
+	if (entries.size()) {
+		BuildContext context;
+		context.nodes.reserve(entries.size() * 2);
+		if (mSettings.builder == BVHBuilder::Morton) {
+			BuildMorton(entries, context);
+		} else if (mSettings.builder == BVHBuilder::SpatialSplits) {
+			BuildSpatial(entries, context);
+		} else {
+			GenerateNode(entries, 0, (u32)entries.size(), 0, mSettings.threadCount, context);
+		}
+		mNodes.swap(context.nodes);
+		// reserved for a leaf per entry, most of that is never used
+		mNodes.shrink_to_fit();
+		mDepth = context.depth;
+		mLeafCount = context.leafCount;
+	}
+
+	// every builder leaves the entries in leaf order
+	mPrimitiveIndices.resize(entries.size());
+	for (size_t i = 0; i < entries.size(); ++i) {
+		mPrimitiveIndices[i] = entries[i].index;
+	}
+
+	PadLeavesToBlocks();
+
+	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+	mBuildTime = std::chrono::duration<r32, std::milli>(end - start).count();
+	mBuildCost = ComputeCost();
+}
+
+void BVH::PadLeavesToBlocks() {
+	// without AVX2 the leaves are tested a triangle at a time, they need neither the padding nor the blocks
+#if defined(__AVX2__)
+	if (!IsMeshBVH()) {
+		return;
+	}
+
+	std::vector<u32> padded;
+	padded.reserve(mPrimitiveIndices.size() * 2);
+	for (auto& node : mNodes) {
+		if (!node.IsLeaf()) {
+			continue;
+		}
+		u32 start = (u32)padded.size();
+		padded.insert(padded.end(), mPrimitiveIndices.begin() + node.offset, mPrimitiveIndices.begin() + node.offset + node.count);
+		padded.resize((padded.size() + BlockSize - 1) / BlockSize * BlockSize, InvalidPrimitive);
+		node.offset = start;
+	}
+	padded.shrink_to_fit();
+	mPrimitiveIndices.swap(padded);
+
+	UpdateTriangleBlocks();
+#endif
+}
+
+void BVH::UpdateTriangleBlocks() {
+#if defined(__AVX2__)
+	if (!IsMeshBVH()) {
+		mTriangleBlocks.clear();
+		return;
+	}
+
+	mTriangleBlocks.resize(mPrimitiveIndices.size() / BlockSize);
+	for (size_t b = 0; b < mTriangleBlocks.size(); ++b) {
+		TriangleBlock& block = mTriangleBlocks[b];
+		for (u32 i = 0; i < BlockSize; ++i) {
+			u32 index = mPrimitiveIndices[b * BlockSize + i];
+			if (index == InvalidPrimitive) {
+				block.ax[i] = block.ay[i] = block.az[i] = 0;
+				block.abx[i] = block.aby[i] = block.abz[i] = 0;
+				block.acx[i] = block.acy[i] = block.acz[i] = 0;
+				continue;
+			}
+
+			Triangle t = mMesh->GetTriangle(index);
+			v3 ab = t.B - t.A;
+			v3 ac = t.C - t.A;
+			block.ax[i] = t.A.x;
+			block.ay[i] = t.A.y;
+			block.az[i] = t.A.z;
+			block.abx[i] = ab.x;
+			block.aby[i] = ab.y;
+			block.abz[i] = ab.z;
+			block.acx[i] = ac.x;
+			block.acy[i] = ac.y;
+			block.acz[i] = ac.z;
+		}
+	}
+#endif
+}
+
+void BVH::Rebuild() {
+	std::vector<BuildEntry> entries;
+	entries.reserve(PrimitiveCount());
+	for (u32 i = 0; i < PrimitiveCount(); ++i) {
+		BoundingBox box = EntryBounds(i);
+		entries.push_back({ box, box.position, i });
+	}
+
+	Build(entries);
+	SortTypedArrays();
+	Collapse();
+}
+
+// BuildFromScene filled the arrays in scene order, this puts them in the order the leaves reference them,
+// so the spheres or cubes next to each other in a leaf sit in consecutive slots and get tested in one loop
+void BVH::SortTypedArrays() {
+	if (mSpheres.Size() == 0 && mCubes.Size() == 0) {
+		return;
+	}
+
+	SphereArray spheres;
+	CubeArray cubes;
+	// spatial splits can reference a primitive from more than one leaf, it keeps the first slot
+	std::vector<u8> placed(mPrimitives.size(), 0);
+	for (u32 index : mPrimitiveIndices) {
+		if (index == InvalidPrimitive || placed[index]) {
+			continue;
+		}
+		placed[index] = 1;
+
+		BVHPrimitive& primitive = mPrimitives[index];
+		if (primitive.type == PrimitiveType::Sphere) {
+			primitive.index = spheres.Add(mSpheres.objects[primitive.index]);
+		} else if (primitive.type == PrimitiveType::Cube) {
+			primitive.index = cubes.Add(mCubes.objects[primitive.index]);
+		}
+	}
+	mSpheres = std::move(spheres);
+	mCubes = std::move(cubes);
+}
+
+r32 BVH::ComputeCost() const {
+	if (mNodes.empty()) {
+		return 0;
+	}
+
+	r32 rootArea = BoundingBox(mNodes[0].min, mNodes[0].max).SurfaceArea();
+	if (rootArea <= 0) {
+		return 0;
+	}
+
+	r32 cost = 0;
+	for (auto& node : mNodes) {
+		r32 area = BoundingBox(node.min, node.max).SurfaceArea();
+		cost += node.IsLeaf() ? area * LeafTests(node.count) * intersectionCost : area * traversalCost;
+	}
+	return cost / rootArea;
+}
+
+void BVH::MarkDirty(const Object* object) {
+	if (IsMeshBVH()) {
+		mAllDirty = true;
+		return;
+	}
+	for (u32 i = 0; i < mPrimitives.size(); ++i) {
+		if (mPrimitives[i].object == object) {
+			mDirtyPrimitives.push_back(i);
+		}
+	}
+}
+
+BoundingBox BVH::LeafBounds(const BVHNode& node) const {
+	BoundingBox box = BoundingBox::Empty();
+	for (u32 j = node.offset; j < node.offset + node.count; ++j) {
+		box.Extend(EntryBounds(mPrimitiveIndices[j]));
+	}
+	return box;
+}
+
+// true when the node's bounds changed
+static bool SetBounds(BVHNode& node, const BoundingBox& box) {
+	if (box.min.x == node.min.x && box.min.y == node.min.y && box.min.z == node.min.z &&
+		box.max.x == node.max.x && box.max.y == node.max.y && box.max.z == node.max.z) {
+		return false;
+	}
+	node.min = box.min;
+	node.max = box.max;
+	return true;
+}
+
+void BVH::LinkLeaves() {
+	mParents.assign(mNodes.size(), 0);
+	mPrimitiveLeafStart.assign(PrimitiveCount() + 1, 0);
+	for (u32 i = 0; i < mNodes.size(); ++i) {
+		const BVHNode& node = mNodes[i];
+		if (!node.IsLeaf()) {
+			mParents[i + 1] = i;
+			mParents[node.offset] = i;
+			continue;
+		}
+		for (u32 j = node.offset; j < node.offset + node.count; ++j) {
+			++mPrimitiveLeafStart[mPrimitiveIndices[j] + 1];
+		}
+	}
+	for (u32 p = 0; p + 1 < mPrimitiveLeafStart.size(); ++p) {
+		mPrimitiveLeafStart[p + 1] += mPrimitiveLeafStart[p];
+	}
+
+	// spatial splits can put a primitive in more than one leaf
+	std::vector<u32> next(mPrimitiveLeafStart.begin(), mPrimitiveLeafStart.end() - 1);
+	mPrimitiveLeaves.resize(mPrimitiveLeafStart.back());
+	for (u32 i = 0; i < mNodes.size(); ++i) {
+		const BVHNode& node = mNodes[i];
+		if (!node.IsLeaf()) {
+			continue;
+		}
+		for (u32 j = node.offset; j < node.offset + node.count; ++j) {
+			mPrimitiveLeaves[next[mPrimitiveIndices[j]]++] = i;
+		}
+	}
+}
+
+void BVH::LinkWideSlots() {
+	mNodeWideSlots.assign(mNodes.size(), InvalidPrimitive);
+	for (u32 slot = 0; slot < mWideSlotNodes.size(); ++slot) {
+		// empty slots point at the root, which is never a slot itself
+		if (mWideSlotNodes[slot]) {
+			mNodeWideSlots[mWideSlotNodes[slot]] = slot;
+		}
+	}
+}
+
+bool BVH::Refit() {
+	mPlanes.Update();
+	bool allDirty = mAllDirty;
+	if (allDirty) {
+		mSpheres.Update();
+		mCubes.Update();
+	} else {
+		for (u32 p : mDirtyPrimitives) {
+			const BVHPrimitive& primitive = mPrimitives[p];
+			if (primitive.type == PrimitiveType::Sphere) {
+				mSpheres.Copy(primitive.index);
+			} else if (primitive.type == PrimitiveType::Cube) {
+				mCubes.Copy(primitive.index);
+			}
+		}
+	}
+
+	// every binary node whose bounds changed
+	std::vector<u32> changed;
+	if (mNodes.size() && allDirty) {
+		// children always sit behind their parent, so walking the array backwards is bottom up
+		std::vector<u8> dirty(mNodes.size(), 0);
+		for (u32 i = (u32)mNodes.size(); i-- > 0;) {
+			BVHNode& node = mNodes[i];
+			BoundingBox box;
+			if (node.IsLeaf()) {
+				box = LeafBounds(node);
 			} else {
-				if (isLeaf) {
-					node->objectContents.push_back(obj);
+				if (!dirty[i + 1] && !dirty[node.offset]) {
+					continue;
 				}
-				intersected = true;
+				const BVHNode& left = mNodes[i + 1];
+				const BVHNode& right = mNodes[node.offset];
+				box.min = v3::Min(left.min, right.min);
+				box.max = v3::Max(left.max, right.max);
 			}
-			if (!isLeaf) {
-				break;
+			if (SetBounds(node, box)) {
+				dirty[i] = 1;
+				changed.push_back(i);
 			}
 		}
-	}
-#ifdef RENDER_DEBUG_SPHERES
-	//if (node->objectContents.size()) {
-	//}
-	if (node->triangleContents.size()) {
-		Sphere* s1 = new Sphere(node->position, 0.1f);
-		s1->SetColor(v3(0, 0, 1));
-		s1->SetRoughness(1);
-		//s1->SetEmission(v3(1, 0, 0));
-		mScene->AddObject(s1);
-	} else {
-		r32 p = ((r32)currentDepth / (r32)mDepth) * 0.5f;
-		Sphere* s1 = new Sphere(node->position, 0.1f);
-		s1->SetColor(v3(1, 0, 0) * p);
-		s1->SetRoughness(1);
-		//s1->SetEmission(v3(1, 0, 0));
-		mScene->AddObject(s1);
-	}
-#endif
+	} else if (mNodes.size() && mDirtyPrimitives.size()) {
+		if (mParents.empty()) {
+			LinkLeaves();
+		}
+		std::vector<u32> leaves;
+		for (u32 p : mDirtyPrimitives) {
+			leaves.insert(leaves.end(), mPrimitiveLeaves.begin() + mPrimitiveLeafStart[p], mPrimitiveLeaves.begin() + mPrimitiveLeafStart[p + 1]);
+		}
+		std::sort(leaves.begin(), leaves.end());
+		leaves.erase(std::unique(leaves.begin(), leaves.end()), leaves.end());
 
-	if (intersected && isLeaf) {
-		++numberOfLeafs;
+		// up from every leaf until a parent comes out the same, everything above it already covers the change
+		for (u32 leaf : leaves) {
+			u32 i = leaf;
+			BoundingBox box = LeafBounds(mNodes[i]);
+			while (SetBounds(mNodes[i], box)) {
+				changed.push_back(i);
+				if (i == 0) {
+					break;
+				}
+				i = mParents[i];
+				const BVHNode& left = mNodes[i + 1];
+				const BVHNode& right = mNodes[mNodes[i].offset];
+				box.min = v3::Min(left.min, right.min);
+				box.max = v3::Max(left.max, right.max);
+			}
+		}
 	}
+	mDirtyPrimitives.clear();
+	mAllDirty = false;
 
-	if (intersected && !isLeaf) {
-		v3 offset[8] = {
-			v3(-1, 1, 1),
-			v3(-1, -1, 1),
-			v3(1, 1, 1),
-			v3(1, -1, 1),
+	// triangles can move without their leaf's bounds changing
+	if (allDirty) {
+		UpdateTriangleBlocks();
+	}
+	if (changed.empty()) {
+		return true;
+	}
 
-			v3(-1, 1, -1),
-			v3(-1, -1, -1),
-			v3(1, 1, -1),
-			v3(1, -1, -1)
-		};
-		for (int i = 0; i < 8; ++i) {
-			node->children[i] = GenerateNode(objects, node, 
-				node->position + v3::Hadamard(node->size / offsetDivider, offset[i]),
-				currentDepth + 1);
+	if (mWideNodes.size()) {
+		if (mNodeWideSlots.empty()) {
+			LinkWideSlots();
 		}
+		for (u32 i : changed) {
+			u32 slot = mNodeWideSlots[i];
+			if (slot == InvalidPrimitive) {
+				continue;
+			}
+			const BVHNode& n = mNodes[i];
+			BVH8Node& wide = mWideNodes[slot / 8];
+			u32 j = slot % 8;
+			wide.minX[j] = n.min.x;
+			wide.minY[j] = n.min.y;
+			wide.minZ[j] = n.min.z;
+			wide.maxX[j] = n.max.x;
+			wide.maxY[j] = n.max.y;
+			wide.maxZ[j] = n.max.z;
+		}
+	}
+
+	// the grids depend on every child, compressed trees are collapsed again from the refitted nodes
+	if (mCompressedNodes.size()) {
+		Collapse();
 	}
 
-	return node;
+	return ComputeCost() <= mBuildCost * mSettings.refitThreshold;
 }
 
-BVH BVH::BuildFromScene(Scene* scene, int depth) {
+void BVH::Update() {
+	if (!Refit()) {
+		Rebuild();
+	}
+}
+
+BVH BVH::BuildFromScene(Scene* scene) {
 	BVH result;
 	result.mScene = scene;
-	result.mDepth = depth;
-	// TODO Just call generate node
-	result.mRoot = new BVHNode(defaultStartingPosition, defaultStartingSize, nullptr);
-	v3 offset[8] = {
-		v3(-1, 1, 1),
-		v3(-1, -1, 1),
-		v3(1, 1, 1),
-		v3(1, -1, 1),
-
-		v3(-1, 1, -1),
-		v3(-1, -1, -1),
-		v3(1, 1, -1),
-		v3(1, -1, -1)
-	};
+	result.mSettings = scene->mBVHSettings;
+	// the previous build's debug spheres would end up in this one
+	scene->RemoveDebugObjects();
+
+	std::vector<BuildEntry> entries;
+	for (auto& obj : scene->mObjects) {
+		if (obj->mIsMesh) {
+			TriangleArray* mesh = dynamic_cast<TriangleArray*>(obj);
+			if (!mesh->mBVH) {
+				mesh->BuildBVH(scene->mBVHSettings);
+			}
+		}
+
+		BoundingBox box;
+		if (!obj->GetBoundingBox(box)) {
+			if (Plane* plane = dynamic_cast<Plane*>(obj)) {
+				result.mPlanes.Add(plane);
+			} else {
+				result.mUnboundedObjects.push_back(obj);
+			}
+			continue;
+		}
+		// an empty mesh, or an instance of one, has nothing to put in a leaf and would poison the binning
+		if (!box.Valid()) {
+			continue;
+		}
+
+		// sorted into the typed arrays once here, so the leaves never ask again
+		BVHPrimitive primitive = { obj, 0, PrimitiveType::Other };
+		if (Sphere* sphere = dynamic_cast<Sphere*>(obj)) {
+			primitive.type = PrimitiveType::Sphere;
+			primitive.index = result.mSpheres.Add(sphere);
+		} else if (Cube* cube = dynamic_cast<Cube*>(obj)) {
+			primitive.type = PrimitiveType::Cube;
+			primitive.index = result.mCubes.Add(cube);
+		} else if (dynamic_cast<TriangleArray*>(obj)) {
+			primitive.type = PrimitiveType::Mesh;
+		} else if (dynamic_cast<MeshInstance*>(obj)) {
+			primitive.type = PrimitiveType::Instance;
+		}
+
+		entries.push_back({ box, box.position, (u32)result.mPrimitives.size() });
+		result.mPrimitives.push_back(primitive);
+	}
+
+	result.Build(entries);
+	result.SortTypedArrays();
+	result.Collapse();
+
 #ifdef RENDER_DEBUG_SPHERES
-	Sphere* s1 = new Sphere(result.mRoot->position, 0.1f);
-	s1->SetColor(v3(0, 1, 0));
-	s1->SetRoughness(1);
-	//s1->SetEmission(v3(1, 0, 0));
-	result.mScene->AddObject(s1);
+	if (result.mNodes.size()) {
+		result.AddDebugSpheres(0, 0);
+		result.Rebuild();
+	}
 #endif
-	for (int i = 0; i < 8; ++i) {
-		result.mRoot->children[i] = result.GenerateNode(scene->mObjects, result.mRoot, 
-			result.mRoot->position + v3::Hadamard(result.mRoot->size / offsetDivider, offset[i]),
-			0);
+
+	std::cout << "Number of leafs: " << result.mLeafCount << std::endl;
+	std::cout << "BVH build took " << result.mBuildTime << "[ms] on " << result.mSettings.threadCount << " threads" << std::endl;
+	std::cout << "BVH SAH cost " << result.ComputeCost() << std::endl;
+
+	return result;
+}
+
+BVH BVH::BuildFromMesh(TriangleArray* mesh, const BVHBuildSettings& settings) {
+	BVH result;
+	result.mSettings = settings;
+#if defined(__AVX2__)
+	// a leaf is tested a whole block at a time, so it may as well fill one
+	result.mSettings.maxLeafSize = (settings.maxLeafSize + BlockSize - 1) / BlockSize * BlockSize;
+#endif
+
+	result.mMesh = mesh;
+
+	std::string cachePath;
+	u64 key = 0;
+	if (settings.cacheDirectory) {
+		key = CacheKey(mesh, settings);
+		char name[32];
+		snprintf(name, sizeof(name), "/%016llx.bvh", (unsigned long long)key);
+		cachePath = std::string(settings.cacheDirectory) + name;
+		if (result.LoadCache(cachePath.c_str(), key)) {
+			result.UpdateTriangleBlocks();
+			return result;
+		}
+	}
+
+	std::vector<BuildEntry> entries;
+	entries.reserve(mesh->TriangleCount());
+	for (u32 i = 0; i < mesh->TriangleCount(); ++i) {
+		BoundingBox box = result.EntryBounds(i);
+		entries.push_back({ box, box.position, i });
 	}
 
-	std::cout << "Number of leafs: " << numberOfLeafs << std::endl;
+	result.Build(entries);
+	result.Collapse();
+
+	if (settings.cacheDirectory && !result.SaveCache(cachePath.c_str(), key)) {
+		std::cout << "Couldn't write the BVH cache " << cachePath << std::endl;
+	}
 
 	return result;
 }
 
-void BVH::SelectHitLeafsFromRay(Ray& ray, BVHNode* node, std::vector<BVHNode*>& result) {
-	BVHNode* currentNode = node;
-	if (!currentNode) {
+#if defined(__AVX2__)
+// Moller-Trumbore against all 8 triangles of a block, returns the lane of the nearest hit inside the ray's interval or -1
+static int IntersectBlock(const TriangleBlock& block, const Ray& ray, r32& t) {
+	__m256 dx = _mm256_set1_ps(ray.direction.x);
+	__m256 dy = _mm256_set1_ps(ray.direction.y);
+	__m256 dz = _mm256_set1_ps(ray.direction.z);
+	__m256 abx = _mm256_load_ps(block.abx);
+	__m256 aby = _mm256_load_ps(block.aby);
+	__m256 abz = _mm256_load_ps(block.abz);
+	__m256 acx = _mm256_load_ps(block.acx);
+	__m256 acy = _mm256_load_ps(block.acy);
+	__m256 acz = _mm256_load_ps(block.acz);
+
+	// p = d x ac
+	__m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, acz), _mm256_mul_ps(dz, acy));
+	__m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, acx), _mm256_mul_ps(dx, acz));
+	__m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, acy), _mm256_mul_ps(dy, acx));
+	__m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(abx, px), _mm256_mul_ps(aby, py)), _mm256_mul_ps(abz, pz));
+	__m256 invDet = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+
+	__m256 sx = _mm256_sub_ps(_mm256_set1_ps(ray.origin.x), _mm256_load_ps(block.ax));
+	__m256 sy = _mm256_sub_ps(_mm256_set1_ps(ray.origin.y), _mm256_load_ps(block.ay));
+	__m256 sz = _mm256_sub_ps(_mm256_set1_ps(ray.origin.z), _mm256_load_ps(block.az));
+	__m256 bu = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, px), _mm256_mul_ps(sy, py)), _mm256_mul_ps(sz, pz)), invDet);
+
+	// q = s x ab
+	__m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, abz), _mm256_mul_ps(sz, aby));
+	__m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, abx), _mm256_mul_ps(sx, abz));
+	__m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, aby), _mm256_mul_ps(sy, abx));
+	__m256 bv = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), invDet);
+	__m256 tv = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(acx, qx), _mm256_mul_ps(acy, qy)), _mm256_mul_ps(acz, qz)), invDet);
+
+	// ordered compares, so the NaNs and infinities of empty lanes and parallel rays all fail
+	__m256 zero = _mm256_setzero_ps();
+	__m256 one = _mm256_set1_ps(1.0f);
+	__m256 uv = _mm256_add_ps(bu, bv);
+	__m256 nearT = _mm256_set1_ps(ray.tMin);
+	__m256 farT = _mm256_set1_ps(ray.tMax);
+#if defined(__AVX512F__) && defined(__AVX512VL__)
+	__mmask8 hits = _mm256_cmp_ps_mask(bu, zero, _CMP_GE_OQ);
+	hits = _mm256_mask_cmp_ps_mask(hits, bv, zero, _CMP_GE_OQ);
+	hits = _mm256_mask_cmp_ps_mask(hits, uv, one, _CMP_LE_OQ);
+	hits = _mm256_mask_cmp_ps_mask(hits, tv, nearT, _CMP_GT_OQ);
+	hits = _mm256_mask_cmp_ps_mask(hits, tv, farT, _CMP_LT_OQ);
+	if (!hits) {
+		return -1;
+	}
+	__m256 candidates = _mm256_mask_blend_ps(hits, _mm256_set1_ps(std::numeric_limits<r32>::infinity()), tv);
+	u32 mask = (u32)hits;
+#else
+	__m256 hits = _mm256_and_ps(_mm256_cmp_ps(bu, zero, _CMP_GE_OQ), _mm256_cmp_ps(bv, zero, _CMP_GE_OQ));
+	hits = _mm256_and_ps(hits, _mm256_cmp_ps(uv, one, _CMP_LE_OQ));
+	hits = _mm256_and_ps(hits, _mm256_cmp_ps(tv, nearT, _CMP_GT_OQ));
+	hits = _mm256_and_ps(hits, _mm256_cmp_ps(tv, farT, _CMP_LT_OQ));
+	u32 mask = (u32)_mm256_movemask_ps(hits);
+	if (!mask) {
+		return -1;
+	}
+	__m256 candidates = _mm256_blendv_ps(_mm256_set1_ps(std::numeric_limits<r32>::infinity()), tv, hits);
+#endif
+
+	// horizontal min, then the first lane holding it
+	__m256 m = _mm256_min_ps(candidates, _mm256_permute2f128_ps(candidates, candidates, 1));
+	m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+	m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+	mask &= (u32)_mm256_movemask_ps(_mm256_cmp_ps(candidates, m, _CMP_EQ_OQ));
+	t = _mm_cvtss_f32(_mm256_castps256_ps128(m));
+
+	int lane = 0;
+	while (!(mask & (1u << lane))) {
+		++lane;
+	}
+	return lane;
+}
+#endif
+
+// AnyHit only answers whether anything is hit, the casts are safe because BuildFromScene set the type
+template <bool AnyHit>
+bool BVH::IntersectPrimitive(const BVHPrimitive& primitive, u32 count, Ray& ray, HitRecord& closestHit, TraceStats& stats) const {
+	switch (primitive.type) {
+	case PrimitiveType::Sphere:
+		return AnyHit ? mSpheres.Occluded(primitive.index, primitive.index + count, ray) : mSpheres.Intersect(primitive.index, primitive.index + count, ray, closestHit);
+	case PrimitiveType::Cube:
+		return AnyHit ? mCubes.Occluded(primitive.index, primitive.index + count, ray) : mCubes.Intersect(primitive.index, primitive.index + count, ray, closestHit);
+	case PrimitiveType::Mesh: {
+		TriangleArray* mesh = static_cast<TriangleArray*>(primitive.object);
+		return AnyHit ? mesh->Occluded(ray, stats) : mesh->Intersect(ray, closestHit, stats);
+	}
+	case PrimitiveType::Instance: {
+		MeshInstance* instance = static_cast<MeshInstance*>(primitive.object);
+		return AnyHit ? instance->Occluded(ray, stats) : instance->Intersect(ray, closestHit, stats);
+	}
+	default:
+		return AnyHit ? primitive.object->Occluded(ray) : primitive.object->Intersect(ray, closestHit);
+	}
+}
+
+template <bool AnyHit>
+void BVH::IntersectLeaf(Ray& ray, u32 offset, u32 count, HitRecord& closestHit, bool& hit, TraceStats& stats) const {
+	++stats.leavesTested;
+#if defined(__AVX2__)
+	if (mTriangleBlocks.size()) {
+		// the padding lanes aren't counted
+		stats.trianglesTested += count;
+		for (u32 b = offset / BlockSize; b < (offset + count + BlockSize - 1) / BlockSize; ++b) {
+			const TriangleBlock& block = mTriangleBlocks[b];
+			r32 t;
+			int lane = IntersectBlock(block, ray, t);
+			if (lane < 0) {
+				continue;
+			}
+			if (AnyHit) {
+				hit = true;
+				return;
+			}
+
+			closestHit.t = t;
+			closestHit.object = mMesh;
+			closestHit.primitive = mPrimitiveIndices[b * BlockSize + lane];
+			ray.tMax = t;
+			hit = true;
+		}
+		return;
+	}
+#endif
+
+	// one triangle at a time without AVX2, straight from the mesh's vertices
+	if (mMesh) {
+		stats.trianglesTested += count;
+		for (u32 i = offset; i < offset + count; ++i) {
+			if (AnyHit) {
+				r32 t;
+				if (Intersections::RayTriangle(mMesh->GetTriangle(mPrimitiveIndices[i]), ray, t)) {
+					hit = true;
+					return;
+				}
+			} else if (mMesh->IntersectTriangle(ray, mPrimitiveIndices[i], closestHit)) {
+				ray.tMax = closestHit.t;
+				hit = true;
+			}
+		}
 		return;
 	}
 
-	BoundingBox b(currentNode->position - (currentNode->size / 2.0),
-		currentNode->position + (currentNode->size / 2.0));
+	for (u32 i = offset; i < offset + count; ++i) {
+		const BVHPrimitive& primitive = mPrimitives[mPrimitiveIndices[i]];
+		// spheres or cubes in consecutive slots go to their array as one run
+		u32 run = 1;
+		if (primitive.type == PrimitiveType::Sphere || primitive.type == PrimitiveType::Cube) {
+			while (i + run < offset + count) {
+				const BVHPrimitive& next = mPrimitives[mPrimitiveIndices[i + run]];
+				if (next.type != primitive.type || next.index != primitive.index + run) {
+					break;
+				}
+				++run;
+			}
+		}
+
+		// anything that comes back lies inside the ray's interval, so it's the closest so far
+		bool found = IntersectPrimitive<AnyHit>(primitive, run, ray, closestHit, stats);
+		i += run - 1;
+		if (found) {
+			hit = true;
+			if (AnyHit) {
+				return;
+			}
+			ray.tMax = closestHit.t;
+		}
+	}
+}
+
+bool BVH::Intersect(Ray& ray, HitRecord& closestHit, TraceStats& stats) const {
+	if (mCompressedNodes.size()) {
+		return IntersectWide<false>(mCompressedNodes, ray, closestHit, stats);
+	}
+	if (mWideNodes.size()) {
+		return IntersectWide<false>(mWideNodes, ray, closestHit, stats);
+	}
+	return IntersectBinary<false>(ray, closestHit, stats);
+}
+
+bool BVH::Occluded(const Ray& ray, TraceStats& stats) const {
+	// the walk stops at the first hit, neither of these changes before that
+	Ray r = ray;
+	HitRecord unused;
+	if (mCompressedNodes.size()) {
+		return IntersectWide<true>(mCompressedNodes, r, unused, stats);
+	}
+	if (mWideNodes.size()) {
+		return IntersectWide<true>(mWideNodes, r, unused, stats);
+	}
+	return IntersectBinary<true>(r, unused, stats);
+}
+
+template <bool AnyHit>
+bool BVH::IntersectBinary(Ray& ray, HitRecord& closestHit, TraceStats& stats) const {
+	if (mNodes.empty()) {
+		return false;
+	}
+
+	v3 invDirection(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+
+	r32 tEntry;
+	if (!Intersections::RayAABB(mNodes[0].min, mNodes[0].max, ray.origin, invDirection, ray.tMin, ray.tMax, tEntry)) {
+		return false;
+	}
+
+	struct StackEntry {
+		u32 node;
+		r32 tEntry;
+	};
+	StackEntry stack[MaxDepth + 1];
+	int top = 0;
+
+	bool hit = false;
+	u32 nodeIndex = 0;
+	while (true) {
+		const BVHNode& node = mNodes[nodeIndex];
+		++stats.nodesVisited;
+
+		if (node.IsLeaf()) {
+			IntersectLeaf<AnyHit>(ray, node.offset, node.count, closestHit, hit, stats);
+			if (AnyHit && hit) {
+				return true;
+			}
+		} else {
+			u32 first = nodeIndex + 1;
+			u32 second = node.offset;
+			r32 tFirst;
+			r32 tSecond;
+			bool hitFirst = Intersections::RayAABB(mNodes[first].min, mNodes[first].max, ray.origin, invDirection, ray.tMin, ray.tMax, tFirst);
+			bool hitSecond = Intersections::RayAABB(mNodes[second].min, mNodes[second].max, ray.origin, invDirection, ray.tMin, ray.tMax, tSecond);
+
+			if (hitFirst && hitSecond) {
+				if (tSecond < tFirst) {
+					std::swap(first, second);
+					std::swap(tFirst, tSecond);
+				}
+				stack[top++] = { second, tSecond };
+				nodeIndex = first;
+				continue;
+			}
+			if (hitFirst) {
+				nodeIndex = first;
+				continue;
+			}
+			if (hitSecond) {
+				nodeIndex = second;
+				continue;
+			}
+		}
+
+		// pop until something is still in front of the closest hit
+		bool found = false;
+		while (top) {
+			StackEntry entry = stack[--top];
+			if (entry.tEntry <= ray.tMax) {
+				nodeIndex = entry.node;
+				found = true;
+				break;
+			}
+		}
+		if (!found) {
+			break;
+		}
+	}
+
+	return hit;
+}
+
+u32 BVH::CollapseNode(u32 nodeIndex) {
+	// open up the biggest interior child until all 8 slots are taken
+	u32 slots[8];
+	int slotCount = 0;
+	slots[slotCount++] = nodeIndex + 1;
+	slots[slotCount++] = mNodes[nodeIndex].offset;
 
-	if (Intersections::RayAABB(b, ray)) {
-		if (currentNode->isLeaf) {
-			if (currentNode->objectContents.size() || currentNode->triangleContents.size()) {
-				result.push_back(currentNode);
+	while (slotCount < 8) {
+		int best = -1;
+		r32 bestArea = -1;
+		for (int i = 0; i < slotCount; ++i) {
+			const BVHNode& n = mNodes[slots[i]];
+			if (n.IsLeaf()) {
+				continue;
 			}
+			r32 area = BoundingBox(n.min, n.max).SurfaceArea();
+			if (area > bestArea) {
+				bestArea = area;
+				best = i;
+			}
+		}
+		if (best < 0) {
+			break;
+		}
+
+		u32 opened = slots[best];
+		slots[best] = opened + 1;
+		slots[slotCount++] = mNodes[opened].offset;
+	}
+
+	u32 wideIndex = (u32)mWideNodes.size();
+	mWideNodes.push_back({});
+	mWideSlotNodes.resize(mWideNodes.size() * 8, 0);
+
+	BVH8Node wide = {};
+	for (int i = 0; i < 8; ++i) {
+		if (i >= slotCount) {
+			wide.minX[i] = wide.minY[i] = wide.minZ[i] = std::numeric_limits<r32>::max();
+			wide.maxX[i] = wide.maxY[i] = wide.maxZ[i] = -std::numeric_limits<r32>::max();
+			wide.child[i] = 0;
+			wide.count[i] = 0;
+			continue;
+		}
+
+		mWideSlotNodes[wideIndex * 8 + i] = slots[i];
+		const BVHNode& n = mNodes[slots[i]];
+		wide.minX[i] = n.min.x;
+		wide.minY[i] = n.min.y;
+		wide.minZ[i] = n.min.z;
+		wide.maxX[i] = n.max.x;
+		wide.maxY[i] = n.max.y;
+		wide.maxZ[i] = n.max.z;
+		if (n.IsLeaf()) {
+			wide.child[i] = n.offset;
+			wide.count[i] = n.count;
 		} else {
+			wide.child[i] = CollapseNode(slots[i]);
+			wide.count[i] = 0;
+		}
+	}
+	mWideNodes[wideIndex] = wide;
+
+	return wideIndex;
+}
+
+void BVH::Collapse() {
+	mWideNodes.clear();
+	mWideSlotNodes.clear();
+	mNodeWideSlots.clear();
+	// traversal prefers whatever is left here, a rebuild into a leaf root must not find the old tree
+	mCompressedNodes.clear();
+	// a lone leaf at the root stays on the binary path
+	if (mNodes.empty() || mNodes[0].IsLeaf()) {
+		return;
+	}
+	mWideNodes.reserve(mNodes.size() / 4 + 1);
+	CollapseNode(0);
+
+	if (mSettings.compressNodes && CompressNodes()) {
+		std::vector<BVH8Node>().swap(mWideNodes);
+	}
+}
+
+// 2^e for e in [-126, 127], built straight from the exponent bits
+static r32 Exp2(int e) {
+	u32 bits = (u32)(e + 127) << 23;
+	r32 result;
+	memcpy(&result, &bits, sizeof(result));
+	return result;
+}
+
+bool BVH::CompressNodes() {
+	mCompressedNodes.resize(mWideNodes.size());
+	for (size_t n = 0; n < mWideNodes.size(); ++n) {
+		const BVH8Node& wide = mWideNodes[n];
+		BVH8CompressedNode& node = mCompressedNodes[n];
+		node = {};
+
+		const r32* mins[3] = { wide.minX, wide.minY, wide.minZ };
+		const r32* maxs[3] = { wide.maxX, wide.maxY, wide.maxZ };
+		u8* qmins[3] = { node.qminX, node.qminY, node.qminZ };
+		u8* qmaxs[3] = { node.qmaxX, node.qmaxY, node.qmaxZ };
+
+		for (int axis = 0; axis < 3; ++axis) {
+			r32 lo = std::numeric_limits<r32>::max();
+			r32 hi = -std::numeric_limits<r32>::max();
 			for (int i = 0; i < 8; ++i) {
-				SelectHitLeafsFromRay(ray, currentNode->children[i], result);
+				if (wide.child[i] || wide.count[i]) {
+					lo = std::min(lo, mins[axis][i]);
+					hi = std::max(hi, maxs[axis][i]);
+				}
+			}
+
+			// smallest power of two step that still reaches hi in 255 steps
+			int e = -126;
+			if (hi > lo) {
+				std::frexp((hi - lo) / 255, &e);
+				e = std::max(-126, std::min(127, e));
+			}
+			while (e < 127 && lo + 255 * Exp2(e) < hi) {
+				++e;
+			}
+			r32 scale = Exp2(e);
+			node.origin[axis] = lo;
+			node.exponent[axis] = (s8)e;
+
+			// q * scale is exact, so these checks see the same numbers the traversal decodes
+			for (int i = 0; i < 8; ++i) {
+				if (!wide.child[i] && !wide.count[i]) {
+					qmins[axis][i] = 255;
+					qmaxs[axis][i] = 0;
+					continue;
+				}
+				int qmin = std::max(0, std::min(255, (int)std::floor((mins[axis][i] - lo) / scale)));
+				while (qmin > 0 && lo + qmin * scale > mins[axis][i]) {
+					--qmin;
+				}
+				int qmax = std::max(0, std::min(255, (int)std::ceil((maxs[axis][i] - lo) / scale)));
+				while (qmax < 255 && lo + qmax * scale < maxs[axis][i]) {
+					++qmax;
+				}
+				qmins[axis][i] = (u8)qmin;
+				qmaxs[axis][i] = (u8)qmax;
+			}
+		}
+
+		for (int i = 0; i < 8; ++i) {
+			// leaves this big only come out of the depth limit, keep the exact nodes then
+			if (wide.count[i] > 0xffff) {
+				mCompressedNodes.clear();
+				return false;
+			}
+			node.child[i] = wide.child[i];
+			node.count[i] = (u16)wide.count[i];
+		}
+	}
+	return true;
+}
+
+#if defined(__AVX2__)
+// slab test of one ray against 8 boxes at once, returns a bit per box that was hit
+static u32 IntersectBoxes(__m256 minX, __m256 minY, __m256 minZ, __m256 maxX, __m256 maxY, __m256 maxZ,
+	const v3& origin, const v3& invDirection, r32 tMin, r32 tMax, r32 tEntry[8]) {
+	__m256 ox = _mm256_set1_ps(origin.x);
+	__m256 oy = _mm256_set1_ps(origin.y);
+	__m256 oz = _mm256_set1_ps(origin.z);
+	__m256 ix = _mm256_set1_ps(invDirection.x);
+	__m256 iy = _mm256_set1_ps(invDirection.y);
+	__m256 iz = _mm256_set1_ps(invDirection.z);
+
+	__m256 tx1 = _mm256_mul_ps(_mm256_sub_ps(minX, ox), ix);
+	__m256 tx2 = _mm256_mul_ps(_mm256_sub_ps(maxX, ox), ix);
+	__m256 ty1 = _mm256_mul_ps(_mm256_sub_ps(minY, oy), iy);
+	__m256 ty2 = _mm256_mul_ps(_mm256_sub_ps(maxY, oy), iy);
+	__m256 tz1 = _mm256_mul_ps(_mm256_sub_ps(minZ, oz), iz);
+	__m256 tz2 = _mm256_mul_ps(_mm256_sub_ps(maxZ, oz), iz);
+
+	// NaNs from 0 * inf land in the first operand and max/min hand back the second one
+	__m256 tNear = _mm256_max_ps(_mm256_min_ps(tx1, tx2), _mm256_set1_ps(tMin));
+	__m256 tFar = _mm256_min_ps(_mm256_max_ps(tx1, tx2), _mm256_set1_ps(tMax));
+	tNear = _mm256_max_ps(_mm256_min_ps(ty1, ty2), tNear);
+	tFar = _mm256_min_ps(_mm256_max_ps(ty1, ty2), tFar);
+	tNear = _mm256_max_ps(_mm256_min_ps(tz1, tz2), tNear);
+	tFar = _mm256_min_ps(_mm256_max_ps(tz1, tz2), tFar);
+
+	_mm256_storeu_ps(tEntry, tNear);
+#if defined(__AVX512F__) && defined(__AVX512VL__)
+	return (u32)_mm256_cmp_ps_mask(tNear, tFar, _CMP_LE_OQ);
+#else
+	return (u32)_mm256_movemask_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ));
+#endif
+}
+
+// origin + q * scale for 8 quantized bounds
+static __m256 Dequantize(const u8 q[8], r32 origin, r32 scale) {
+	__m256 f = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)q)));
+	return _mm256_add_ps(_mm256_set1_ps(origin), _mm256_mul_ps(f, _mm256_set1_ps(scale)));
+}
+#endif
+
+// tests the ray against all 8 child boxes at once, returns a bit per child that was hit
+static u32 IntersectChildren(const BVH8Node& node, const v3& origin, const v3& invDirection, r32 tMin, r32 tMax, r32 tEntry[8]) {
+#if defined(__AVX2__)
+	return IntersectBoxes(_mm256_load_ps(node.minX), _mm256_load_ps(node.minY), _mm256_load_ps(node.minZ),
+		_mm256_load_ps(node.maxX), _mm256_load_ps(node.maxY), _mm256_load_ps(node.maxZ),
+		origin, invDirection, tMin, tMax, tEntry);
+#else
+	u32 mask = 0;
+	for (int i = 0; i < 8; ++i) {
+		if (Intersections::RayAABB(v3(node.minX[i], node.minY[i], node.minZ[i]),
+			v3(node.maxX[i], node.maxY[i], node.maxZ[i]), origin, invDirection, tMin, tMax, tEntry[i])) {
+			mask |= 1 << i;
+		}
+	}
+	return mask;
+#endif
+}
+
+// same for quantized children, decoded on the fly
+static u32 IntersectChildren(const BVH8CompressedNode& node, const v3& origin, const v3& invDirection, r32 tMin, r32 tMax, r32 tEntry[8]) {
+	r32 sx = Exp2(node.exponent[0]);
+	r32 sy = Exp2(node.exponent[1]);
+	r32 sz = Exp2(node.exponent[2]);
+#if defined(__AVX2__)
+	return IntersectBoxes(Dequantize(node.qminX, node.origin.x, sx), Dequantize(node.qminY, node.origin.y, sy), Dequantize(node.qminZ, node.origin.z, sz),
+		Dequantize(node.qmaxX, node.origin.x, sx), Dequantize(node.qmaxY, node.origin.y, sy), Dequantize(node.qmaxZ, node.origin.z, sz),
+		origin, invDirection, tMin, tMax, tEntry);
+#else
+	u32 mask = 0;
+	for (int i = 0; i < 8; ++i) {
+		v3 min(node.origin.x + node.qminX[i] * sx, node.origin.y + node.qminY[i] * sy, node.origin.z + node.qminZ[i] * sz);
+		v3 max(node.origin.x + node.qmaxX[i] * sx, node.origin.y + node.qmaxY[i] * sy, node.origin.z + node.qmaxZ[i] * sz);
+		if (Intersections::RayAABB(min, max, origin, invDirection, tMin, tMax, tEntry[i])) {
+			mask |= 1 << i;
+		}
+	}
+	return mask;
+#endif
+}
+
+template <bool AnyHit, typename Node>
+bool BVH::IntersectWide(const std::vector<Node>& nodes, Ray& ray, HitRecord& closestHit, TraceStats& stats) const {
+	v3 invDirection(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+
+	struct StackEntry {
+		u32 child;
+		u32 count;
+		r32 tEntry;
+	};
+	// every wide node pops one entry and pushes at most 8
+	StackEntry stack[MaxDepth * 7 + 1];
+	int top = 0;
+	stack[top++] = { 0, 0, 0 };
+
+	bool hit = false;
+	while (top) {
+		StackEntry entry = stack[--top];
+		if (entry.tEntry > ray.tMax) {
+			continue;
+		}
+
+		if (entry.count) {
+			IntersectLeaf<AnyHit>(ray, entry.child, entry.count, closestHit, hit, stats);
+			if (AnyHit && hit) {
+				return true;
+			}
+			continue;
+		}
+
+		const Node& node = nodes[entry.child];
+		++stats.nodesVisited;
+
+		r32 tEntry[8];
+		u32 mask = IntersectChildren(node, ray.origin, invDirection, ray.tMin, ray.tMax, tEntry);
+
+		// sort the hit children far to near so the nearest one ends up on top of the stack
+		StackEntry hits[8];
+		int hitCount = 0;
+		while (mask) {
+			int i = 0;
+			while (!(mask & (1u << i))) {
+				++i;
+			}
+			mask &= mask - 1;
+			// empty slots point back at the root, which is never anybody's child
+			if (!node.child[i] && !node.count[i]) {
+				continue;
+			}
+
+			StackEntry e = { node.child[i], node.count[i], tEntry[i] };
+			int j = hitCount++;
+			while (j > 0 && hits[j - 1].tEntry < e.tEntry) {
+				hits[j] = hits[j - 1];
+				--j;
 			}
+			hits[j] = e;
+		}
+
+		for (int i = 0; i < hitCount; ++i) {
+			stack[top++] = hits[i];
 		}
 	}
+
+	return hit;
 }
@@ -1,39 +1,234 @@
 #pragma once
 
 #include <vector>
-#include <map>
 
 #include "object.hpp"
 #include "math.hpp"
+#include "primitives.hpp"
 
 class Scene;
 class Ray;
 
-struct BVHNode {
-	bool isLeaf;
-	Math::v3 position;
-	Math::v3 size;
-	std::vector<Object*> objectContents;
-	std::map<Object*, std::vector<Math::Triangle*>> triangleContents;
-	BVHNode* parent;
-	BVHNode* children[8];
+// picks the leaf's intersection routine, only Other goes through the vtable
+enum class PrimitiveType : u32 {
+	Sphere,
+	Cube,
+	Mesh,
+	Instance,
+	Other,
+};
+
+// one reference per object of the top level, mesh BVHs go straight to their triangles instead
+struct BVHPrimitive {
+	Object* object;
+	u32 index; // the slot in BVH::mSpheres or BVH::mCubes, unused otherwise
+	PrimitiveType type;
+};
+
+// 32 bytes, stored depth first so the first child always follows its parent
+struct alignas(32) BVHNode {
+	Math::v3 min;
+	u32 offset; // leaf: first entry in the primitive index buffer, interior: index of the second child
+	Math::v3 max;
+	u32 count; // 0 for interior nodes
+
+	bool IsLeaf() const { return count > 0; }
+};
+static_assert(sizeof(BVHNode) == 32, "BVHNode should fit in half a cache line");
+
+// 8 children per node with the bounds laid out per axis, so one AVX2 register holds
+// the same slab of every child. Empty slots have child and count both 0
+struct alignas(64) BVH8Node {
+	r32 minX[8];
+	r32 minY[8];
+	r32 minZ[8];
+	r32 maxX[8];
+	r32 maxY[8];
+	r32 maxZ[8];
+	u32 child[8]; // interior: wide node index, leaf: first entry in the primitive index buffer
+	u32 count[8]; // 0 for interior children
+};
+static_assert(sizeof(BVH8Node) == 256, "BVH8Node should be exactly 4 cache lines");
+
+// BVH8Node with the child bounds stored as 8 bit steps on a power of two grid anchored at the
+// node's min corner (Ylitie et al. 2017). Decoded boxes always contain the exact ones
+struct alignas(16) BVH8CompressedNode {
+	Math::v3 origin;
+	s8 exponent[3]; // grid step per axis is 2^exponent
+	u8 padding;
+	u8 qminX[8];
+	u8 qminY[8];
+	u8 qminZ[8];
+	u8 qmaxX[8];
+	u8 qmaxY[8];
+	u8 qmaxZ[8];
+	u32 child[8];
+	u16 count[8];
+};
+static_assert(sizeof(BVH8CompressedNode) == 112, "BVH8CompressedNode should be 112 bytes");
 
-	BVHNode() {};
-	BVHNode(Math::v3 p, Math::v3 s, BVHNode* pa) : position(p), size(s), children{}, parent(pa), isLeaf(false){}
+// the triangles of one mesh leaf laid out per component, 8 to a block, for the SIMD ray triangle test.
+// A lane's triangle is the index at the same position in mPrimitiveIndices. Unused lanes have zero edges and never hit
+struct alignas(32) TriangleBlock {
+	r32 ax[8];
+	r32 ay[8];
+	r32 az[8];
+	r32 abx[8];
+	r32 aby[8];
+	r32 abz[8];
+	r32 acx[8];
+	r32 acy[8];
+	r32 acz[8];
+};
+static_assert(sizeof(TriangleBlock) == 288, "TriangleBlock should be 9 AVX registers");
+
+enum class BVHBuilder {
+	BinnedSAH, // slower, better trees, the default
+	Morton, // LBVH, for scenes rebuilt every frame
+	SpatialSplits // SBVH, clips references at split planes, helps meshes with long thin triangles
+};
+
+struct BVHBuildSettings {
+	BVHBuilder builder = BVHBuilder::BinnedSAH;
+	int maxLeafSize = 4; // AVX2 builds round it up to whole TriangleBlocks for meshes
+	int threadCount = 0; // 0 uses every core
+	bool restructure = true; // Morton only, treelet pass over the finished tree
+	r32 splitBudget = 0.3f; // SpatialSplits only, extra references allowed as a fraction of the primitive count
+	r32 refitThreshold = 1.5f; // Update rebuilds once a refit pushes the SAH cost past this times the built cost
+	bool compressNodes = false; // quantized wide nodes, under half the memory for a few more box tests per ray
+	const char* cacheDirectory = nullptr; // meshes load and store their BVH here when set, the directory has to exist
 };
 
 class BVH {
+public:
+	// builder internals, defined in bvh.cpp
+	struct BuildEntry;
+	struct MortonNode;
+
 private:
 	Scene* mScene; // SPONGE
 
 	int mDepth;
+	int mLeafCount;
+	BVHBuildSettings mSettings;
+	r32 mBuildCost;
+	// binary node behind every wide node slot, 8 per wide node, so a refit can patch the wide bounds
+	std::vector<u32> mWideSlotNodes;
+	// what the next Refit looks at, filled by MarkDirty
+	std::vector<u32> mDirtyPrimitives;
+	bool mAllDirty;
+	// built by the first Refit that needs them, Build drops the first three and Collapse the last.
+	// The leaves of primitive p are mPrimitiveLeaves from mPrimitiveLeafStart[p] to mPrimitiveLeafStart[p + 1]
+	std::vector<u32> mParents;
+	std::vector<u32> mPrimitiveLeafStart;
+	std::vector<u32> mPrimitiveLeaves;
+	std::vector<u32> mNodeWideSlots; // InvalidPrimitive for binary nodes without a wide slot
 
-	BVHNode* GenerateNode(std::vector<Object*>& objects, BVHNode* parent, Math::v3 position, int currentDepth);
+	struct BuildContext;
+	bool IsMeshBVH() const { return mMesh != nullptr; }
+	// triangles for mesh BVHs, mPrimitives otherwise
+	u32 PrimitiveCount() const;
+	// whole bounds of what a leaf entry refers to
+	Math::BoundingBox EntryBounds(u32 index) const;
+	// the part of it inside bounds, triangles are clipped to the box
+	Math::BoundingBox ClipEntry(u32 index, const Math::BoundingBox& bounds) const;
+	// what the SAH charges a leaf of count primitives, with AVX2 mesh leaves are tested a TriangleBlock at a time
+	u32 LeafTests(u32 count) const;
+	void Build(std::vector<BuildEntry>& entries);
+	u32 GenerateNode(std::vector<BuildEntry>& entries, u32 start, u32 end, int currentDepth, int threads, BuildContext& context);
+	void BuildMorton(std::vector<BuildEntry>& entries, BuildContext& context);
+	u32 FlattenMortonNode(std::vector<MortonNode>& mortonNodes, const std::vector<BuildEntry>& sorted, u32 ref, int currentDepth, BuildContext& context);
+	void BuildSpatial(std::vector<BuildEntry>& entries, BuildContext& context);
+	u32 GenerateSpatialNode(std::vector<BuildEntry>& refs, int currentDepth, r32 rootArea, u32& budget, std::vector<BuildEntry>& leafRefs, BuildContext& context);
+	void AddDebugSpheres(u32 nodeIndex, int currentDepth);
+	void Rebuild();
+	void PadLeavesToBlocks();
+	void SortTypedArrays();
+	u32 CollapseNode(u32 nodeIndex);
+	void LinkLeaves();
+	void LinkWideSlots();
+	Math::BoundingBox LeafBounds(const BVHNode& node) const;
+	bool CompressNodes();
+	// bvh_cache.cpp, a loaded tree is only used once every index in it is known to be in range
+	bool ValidateCache() const;
+	// spheres and cubes take the run of count slots from primitive.index on, everything else one primitive
+	template <bool AnyHit>
+	bool IntersectPrimitive(const BVHPrimitive& primitive, u32 count, Ray& ray, HitRecord& closestHit, TraceStats& stats) const;
+	// every hit pulls in ray.tMax, AnyHit stops at the first one and leaves closestHit alone
+	template <bool AnyHit>
+	void IntersectLeaf(Ray& ray, u32 offset, u32 count, HitRecord& closestHit, bool& hit, TraceStats& stats) const;
+	template <bool AnyHit>
+	bool IntersectBinary(Ray& ray, HitRecord& closestHit, TraceStats& stats) const;
+	template <bool AnyHit, typename Node>
+	bool IntersectWide(const std::vector<Node>& nodes, Ray& ray, HitRecord& closestHit, TraceStats& stats) const;
 public:
-	BVHNode* mRoot;
+	static constexpr int BinCount = 16;
+	static constexpr int MaxDepth = 64;
+	static constexpr u32 BlockSize = 8;
+	// marks the padding behind a mesh leaf in mPrimitiveIndices
+	static constexpr u32 InvalidPrimitive = 0xffffffff;
+
+	std::vector<BVHNode> mNodes;
+	// mNodes collapsed 8 to 1, traversal prefers these once they exist
+	std::vector<BVH8Node> mWideNodes;
+	// mWideNodes quantized, replaces them when mSettings.compressNodes is set
+	std::vector<BVH8CompressedNode> mCompressedNodes;
+	// top level only
+	std::vector<BVHPrimitive> mPrimitives;
+	// mesh BVHs only, their leaves hold the mesh's triangle indices instead of mPrimitives indices
+	TriangleArray* mMesh;
+	// primitive indices reordered so every leaf covers a contiguous range,
+	// spatial splits can put the same primitive in more than one leaf
+	std::vector<u32> mPrimitiveIndices;
+	// AVX2 mesh BVHs only, the one precomputed copy of the triangles. Leaves start on a multiple
+	// of BlockSize in mPrimitiveIndices so a leaf's triangles are the blocks from offset / BlockSize on
+	std::vector<TriangleBlock> mTriangleBlocks;
+	// top level only, the scene's spheres and cubes by BVHPrimitive::index, in leaf order
+	SphereArray mSpheres;
+	CubeArray mCubes;
+	// planes and anything else without finite bounds, tested for every ray
+	PlaneArray mPlanes;
+	std::vector<Object*> mUnboundedObjects;
+
+	// milliseconds spent in the last build without the wide collapse, or in loading it from the cache
+	r32 mBuildTime;
 
-	BVH() :mDepth(0), mRoot(nullptr) {};
+	BVH() :mScene(nullptr), mDepth(0), mLeafCount(0), mBuildCost(0), mAllDirty(false), mMesh(nullptr), mBuildTime(0) {};
 
-	void SelectHitLeafsFromRay(Ray& ray, BVHNode* node, std::vector<BVHNode*>& result);
-	static BVH BuildFromScene(Scene* scene, int depth);
-};
\ No newline at end of file
+	// rebuilds mWideNodes from mNodes, and mCompressedNodes from those when compression is on
+	void Collapse();
+	// copies the current triangle positions into mTriangleBlocks, after a build, refit or cache load
+	void UpdateTriangleBlocks();
+	// SAH cost of mNodes relative to the root box
+	r32 ComputeCost() const;
+	// the next Refit picks up object's new bounds, for every primitive of a mesh BVH at once.
+	// Linear in the object count, meant for the few objects that move per frame
+	void MarkDirty(const Object* object);
+	void MarkAllDirty() { mAllDirty = true; }
+	// recopies the marked spheres and cubes and mPlanes, then recomputes the bounds of the leaves
+	// holding a marked primitive and of their parents up to the first one that didn't change.
+	// The topology stays, untouched subtrees aren't visited.
+	// References clipped by a spatial split grow back to their whole primitive.
+	// Moved MeshInstances need PushTransforms first. Returns false once the cost grew past
+	// mSettings.refitThreshold times the cost the tree was built with, the bounds are refitted either way
+	bool Refit();
+	// refit, or a full rebuild over the same primitives when the refitted tree got too bad
+	void Update();
+	// closest hit inside the ray's interval, nearest child first. ray.tMax shrinks to every hit found
+	// so subtrees behind it are skipped, closestHit is only written when this returns true
+	bool Intersect(Ray& ray, HitRecord& closestHit, TraceStats& stats) const;
+	// true as soon as anything is hit inside the ray's interval, for shadow and occlusion rays
+	bool Occluded(const Ray& ray, TraceStats& stats) const;
+	// top level, one primitive per object, meshes bring their own bottom level BVH.
+	// Uses scene->mBVHSettings, also for the meshes that don't have a BVH yet
+	static BVH BuildFromScene(Scene* scene);
+	// bottom level, one primitive per triangle in the mesh's own space
+	static BVH BuildFromMesh(TriangleArray* mesh, const BVHBuildSettings& settings = BVHBuildSettings());
+
+	// on disk cache, bvh_cache.cpp. Only the nodes and the primitive order are stored,
+	// mMesh has to be set before loading
+	static u64 CacheKey(const TriangleArray* mesh, const BVHBuildSettings& settings);
+	bool SaveCache(const char* path, u64 key) const;
+	// false when the file is missing, truncated, from another version, for another key or out of range
+	bool LoadCache(const char* path, u64 key);
+};
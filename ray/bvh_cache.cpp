@@ -0,0 +1,345 @@
+#include "bvh.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <type_traits>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace Math;
+
+static_assert(std::is_trivially_copyable<BVHNode>::value, "BVHNode is written to disk as is");
+static_assert(std::is_trivially_copyable<BVH8Node>::value, "BVH8Node is written to disk as is");
+static_assert(std::is_trivially_copyable<BVH8CompressedNode>::value, "BVH8CompressedNode is written to disk as is");
+
+static constexpr u32 CacheMagic = 0x48564252; // "RBVH"
+// bump whenever a node layout or a builder changes, old files are rebuilt then
+static constexpr u32 CacheVersion = 5;
+
+struct BVHCacheHeader {
+	u32 magic;
+	u32 version;
+	u64 key;
+	u32 primitiveCount;
+	u32 nodeCount;
+	u32 wideNodeCount;
+	u32 compressedNodeCount;
+	u32 wideSlotCount;
+	u32 primitiveIndexCount;
+	s32 depth;
+	s32 leafCount;
+	r32 buildCost;
+	u32 padding;
+};
+
+// the arrays follow the header back to back in this order
+static size_t CacheFileSize(const BVHCacheHeader& header) {
+	return sizeof(BVHCacheHeader) +
+		header.nodeCount * sizeof(BVHNode) +
+		header.wideNodeCount * sizeof(BVH8Node) +
+		header.compressedNodeCount * sizeof(BVH8CompressedNode) +
+		header.wideSlotCount * sizeof(u32) +
+		header.primitiveIndexCount * sizeof(u32);
+}
+
+// read only view of a whole file
+struct MappedFile {
+	const u8* data = nullptr;
+	size_t size = 0;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+#else
+	int file = -1;
+#endif
+
+	~MappedFile() {
+		Close();
+	}
+
+	bool Open(const char* path) {
+#ifdef _WIN32
+		file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(file, &fileSize) || !fileSize.QuadPart) {
+			return false;
+		}
+		size = (size_t)fileSize.QuadPart;
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!mapping) {
+			return false;
+		}
+		data = (const u8*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+		file = open(path, O_RDONLY);
+		if (file < 0) {
+			return false;
+		}
+		struct stat info;
+		if (fstat(file, &info) || !info.st_size) {
+			return false;
+		}
+		size = (size_t)info.st_size;
+		void* view = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+		data = view == MAP_FAILED ? nullptr : (const u8*)view;
+#endif
+		return data != nullptr;
+	}
+
+	void Close() {
+#ifdef _WIN32
+		if (data) {
+			UnmapViewOfFile(data);
+		}
+		if (mapping) {
+			CloseHandle(mapping);
+		}
+		if (file != INVALID_HANDLE_VALUE) {
+			CloseHandle(file);
+		}
+		mapping = nullptr;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (data) {
+			munmap((void*)data, size);
+		}
+		if (file >= 0) {
+			close(file);
+		}
+		file = -1;
+#endif
+		data = nullptr;
+		size = 0;
+	}
+};
+
+// FNV-1a
+static u64 Hash(u64 hash, const void* data, size_t size) {
+	const u8* bytes = (const u8*)data;
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+u64 BVH::CacheKey(const TriangleArray* mesh, const BVHBuildSettings& settings) {
+	u64 hash = 0xcbf29ce484222325ull;
+	hash = Hash(hash, &CacheVersion, sizeof(CacheVersion));
+
+	// PushTransforms bakes the transforms into the vertices, so hashing them covers both
+	u32 vertexCount = (u32)mesh->mVertices.size();
+	u32 indexCount = (u32)mesh->mIndices.size();
+	hash = Hash(hash, &vertexCount, sizeof(vertexCount));
+	hash = Hash(hash, &indexCount, sizeof(indexCount));
+	for (auto& v : mesh->mVertices) {
+		r32 p[3] = { v.x, v.y, v.z };
+		hash = Hash(hash, p, sizeof(p));
+	}
+	hash = Hash(hash, mesh->mIndices.data(), mesh->mIndices.size() * sizeof(u32));
+
+	// everything that changes the tree, the thread count doesn't
+	u32 builder = (u32)settings.builder;
+	s32 restructure = settings.restructure;
+	hash = Hash(hash, &builder, sizeof(builder));
+	hash = Hash(hash, &settings.maxLeafSize, sizeof(settings.maxLeafSize));
+	hash = Hash(hash, &restructure, sizeof(restructure));
+	hash = Hash(hash, &settings.splitBudget, sizeof(settings.splitBudget));
+	s32 compressNodes = settings.compressNodes;
+	hash = Hash(hash, &compressNodes, sizeof(compressNodes));
+	// leaves are padded to whole TriangleBlocks only where they exist
+#if defined(__AVX2__)
+	u32 leafGranularity = BlockSize;
+#else
+	u32 leafGranularity = 1;
+#endif
+	hash = Hash(hash, &leafGranularity, sizeof(leafGranularity));
+	return hash;
+}
+
+// interior slots have to point further down the array, so walking a tree always ends
+template <typename Node, typename F>
+static bool ValidWideNodes(const std::vector<Node>& nodes, F validLeaf) {
+	for (u32 n = 0; n < nodes.size(); ++n) {
+		const Node& node = nodes[n];
+		for (int i = 0; i < 8; ++i) {
+			if (node.count[i]) {
+				if (!validLeaf(node.child[i], node.count[i])) {
+					return false;
+				}
+			} else if (node.child[i] && (node.child[i] <= n || node.child[i] >= nodes.size())) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+bool BVH::ValidateCache() const {
+	u32 primitiveCount = PrimitiveCount();
+	u32 indexCount = (u32)mPrimitiveIndices.size();
+	// AVX2 mesh leaves are read a whole TriangleBlock at a time
+#if defined(__AVX2__)
+	u32 granularity = IsMeshBVH() ? BlockSize : 1;
+#else
+	u32 granularity = 1;
+#endif
+	if (indexCount % granularity) {
+		return false;
+	}
+
+	std::vector<u8> covered(indexCount, 0);
+	auto validLeaf = [&](u32 offset, u32 count) {
+		if ((u64)offset + count > indexCount || offset % granularity) {
+			return false;
+		}
+		for (u32 i = offset; i < offset + count; ++i) {
+			if (mPrimitiveIndices[i] >= primitiveCount) {
+				return false;
+			}
+			covered[i] = 1;
+		}
+		return true;
+	};
+
+	u32 nodeCount = (u32)mNodes.size();
+	for (u32 i = 0; i < nodeCount; ++i) {
+		const BVHNode& node = mNodes[i];
+		if (node.IsLeaf()) {
+			if (!validLeaf(node.offset, node.count)) {
+				return false;
+			}
+		} else if (i + 1 >= nodeCount || node.offset <= i + 1 || node.offset >= nodeCount) {
+			return false;
+		}
+	}
+
+	// Collapse keeps only one of the wide forms, with a binary node behind every slot
+	if (mWideNodes.size() && mCompressedNodes.size()) {
+		return false;
+	}
+	if ((mWideNodes.size() || mCompressedNodes.size()) && (!nodeCount || mNodes[0].IsLeaf())) {
+		return false;
+	}
+	if (mWideSlotNodes.size() != (mWideNodes.size() + mCompressedNodes.size()) * 8) {
+		return false;
+	}
+	for (u32 node : mWideSlotNodes) {
+		if (node >= nodeCount) {
+			return false;
+		}
+	}
+	if (!ValidWideNodes(mWideNodes, validLeaf) || !ValidWideNodes(mCompressedNodes, validLeaf)) {
+		return false;
+	}
+
+	// the only entries no leaf reads are the padding up to the next block
+	for (u32 i = 0; i < indexCount; ++i) {
+		if (!covered[i] && mPrimitiveIndices[i] != InvalidPrimitive) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool BVH::SaveCache(const char* path, u64 key) const {
+	FILE* file = fopen(path, "wb");
+	if (!file) {
+		return false;
+	}
+
+	BVHCacheHeader header = {};
+	header.magic = CacheMagic;
+	header.version = CacheVersion;
+	header.key = key;
+	header.primitiveCount = PrimitiveCount();
+	header.nodeCount = (u32)mNodes.size();
+	header.wideNodeCount = (u32)mWideNodes.size();
+	header.compressedNodeCount = (u32)mCompressedNodes.size();
+	header.wideSlotCount = (u32)mWideSlotNodes.size();
+	header.primitiveIndexCount = (u32)mPrimitiveIndices.size();
+	header.depth = mDepth;
+	header.leafCount = mLeafCount;
+	header.buildCost = mBuildCost;
+
+	// a run reading this while it is being written sees a short file and rebuilds
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	ok = ok && fwrite(mNodes.data(), sizeof(BVHNode), mNodes.size(), file) == mNodes.size();
+	ok = ok && fwrite(mWideNodes.data(), sizeof(BVH8Node), mWideNodes.size(), file) == mWideNodes.size();
+	ok = ok && fwrite(mCompressedNodes.data(), sizeof(BVH8CompressedNode), mCompressedNodes.size(), file) == mCompressedNodes.size();
+	ok = ok && fwrite(mWideSlotNodes.data(), sizeof(u32), mWideSlotNodes.size(), file) == mWideSlotNodes.size();
+	ok = ok && fwrite(mPrimitiveIndices.data(), sizeof(u32), mPrimitiveIndices.size(), file) == mPrimitiveIndices.size();
+	ok = fclose(file) == 0 && ok;
+
+	if (!ok) {
+		remove(path);
+	}
+	return ok;
+}
+
+bool BVH::LoadCache(const char* path, u64 key) {
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	MappedFile file;
+	if (!file.Open(path) || file.size < sizeof(BVHCacheHeader)) {
+		return false;
+	}
+
+	BVHCacheHeader header;
+	memcpy(&header, file.data, sizeof(header));
+	if (header.magic != CacheMagic || header.version != CacheVersion || header.key != key ||
+		header.primitiveCount != PrimitiveCount() || file.size != CacheFileSize(header)) {
+		return false;
+	}
+
+	const u8* cursor = file.data + sizeof(header);
+	mNodes.resize(header.nodeCount);
+	memcpy(mNodes.data(), cursor, header.nodeCount * sizeof(BVHNode));
+	cursor += header.nodeCount * sizeof(BVHNode);
+
+	mWideNodes.resize(header.wideNodeCount);
+	memcpy(mWideNodes.data(), cursor, header.wideNodeCount * sizeof(BVH8Node));
+	cursor += header.wideNodeCount * sizeof(BVH8Node);
+
+	mCompressedNodes.resize(header.compressedNodeCount);
+	memcpy(mCompressedNodes.data(), cursor, header.compressedNodeCount * sizeof(BVH8CompressedNode));
+	cursor += header.compressedNodeCount * sizeof(BVH8CompressedNode);
+
+	mWideSlotNodes.resize(header.wideSlotCount);
+	memcpy(mWideSlotNodes.data(), cursor, mWideSlotNodes.size() * sizeof(u32));
+	cursor += mWideSlotNodes.size() * sizeof(u32);
+
+	mPrimitiveIndices.resize(header.primitiveIndexCount);
+	memcpy(mPrimitiveIndices.data(), cursor, header.primitiveIndexCount * sizeof(u32));
+
+	// a damaged file of the right size gets this far, nothing of it may stay behind
+	if (!ValidateCache()) {
+		mNodes.clear();
+		mWideNodes.clear();
+		mCompressedNodes.clear();
+		mWideSlotNodes.clear();
+		mPrimitiveIndices.clear();
+		return false;
+	}
+
+	mDepth = header.depth;
+	mLeafCount = header.leafCount;
+	mBuildCost = header.buildCost;
+
+	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+	mBuildTime = std::chrono::duration<r32, std::milli>(end - start).count();
+	return true;
+}
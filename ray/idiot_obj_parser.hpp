@@ -10,11 +10,16 @@ namespace Import {
 
 using namespace Math;
 
+// positions as they appear in the file, 3 zero based indices per face
+struct OBJMesh {
+	std::vector<v3> positions;
+	std::vector<u32> indices;
+};
+
 class OBJImporter {
 public:
-	static std::vector<Triangle> LoadFile(const std::string& path) {
-		std::vector<Triangle> result;
-		std::vector<v3> positions;
+	static OBJMesh LoadMesh(const std::string& path) {
+		OBJMesh result;
 
 		std::ifstream file(path);
 		std::string line;
@@ -27,7 +32,7 @@ public:
 				case 'v': {
 					v3 position;
 					s >> position.x >> position.y >> position.z;
-					positions.push_back(position);
+					result.positions.push_back(position);
 					//std::cout << position << std::endl;
 					break;
 				}
@@ -39,11 +44,9 @@ public:
 
 					s >> i0 >> i1 >> i2;
 
-					result.push_back(
-						Triangle(
-							positions[i0 - 1], positions[i1 - 1], positions[i2 - 1]
-						)
-					);
+					result.indices.push_back(i0 - 1);
+					result.indices.push_back(i1 - 1);
+					result.indices.push_back(i2 - 1);
 					break;
 				}
 
@@ -55,6 +58,22 @@ public:
 		file.close();
 		return result;
 	}
+
+	// every face with its own copy of the corners
+	static std::vector<Triangle> LoadFile(const std::string& path) {
+		OBJMesh mesh = LoadMesh(path);
+
+		std::vector<Triangle> result;
+		result.reserve(mesh.indices.size() / 3);
+		for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+			result.push_back(
+				Triangle(
+					mesh.positions[mesh.indices[i]], mesh.positions[mesh.indices[i + 1]], mesh.positions[mesh.indices[i + 2]]
+				)
+			);
+		}
+		return result;
+	}
 };
 
 }
\ No newline at end of file
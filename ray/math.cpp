@@ -2,32 +2,84 @@
 #include "ray.hpp"
 
 bool Intersections::RayAABB(Math::BoundingBox b, Ray r){
+	return RayAABB(b.min, b.max, r);
+}
+
+bool Intersections::RayAABB(const Math::v3& min, const Math::v3& max, const Ray& r) {
 	r32 tmin = std::numeric_limits<r32>::min();
 	r32 tmax = std::numeric_limits<r32>::max();
 
 	if (r.direction.x != 0.0) {
-		r32 tx1 = (b.min.x - r.origin.x) / r.direction.x;
-		r32 tx2 = (b.max.x - r.origin.x) / r.direction.x;
+		r32 tx1 = (min.x - r.origin.x) / r.direction.x;
+		r32 tx2 = (max.x - r.origin.x) / r.direction.x;
 
 		tmin = std::max(tmin, std::min(tx1, tx2));
 		tmax = std::min(tmax, std::max(tx1, tx2));
 	}
 
 	if (r.direction.y != 0.0) {
-		r32 ty1 = (b.min.y - r.origin.y) / r.direction.y;
-		r32 ty2 = (b.max.y - r.origin.y) / r.direction.y;
+		r32 ty1 = (min.y - r.origin.y) / r.direction.y;
+		r32 ty2 = (max.y - r.origin.y) / r.direction.y;
 
 		tmin = std::max(tmin, std::min(ty1, ty2));
 		tmax = std::min(tmax, std::max(ty1, ty2));
 	}
 
 	if (r.direction.z != 0.0) {
-		r32 ty1 = (b.min.z - r.origin.z) / r.direction.z;
-		r32 ty2 = (b.max.z - r.origin.z) / r.direction.z;
+		r32 ty1 = (min.z - r.origin.z) / r.direction.z;
+		r32 ty2 = (max.z - r.origin.z) / r.direction.z;
 
 		tmin = std::max(tmin, std::min(ty1, ty2));
 		tmax = std::min(tmax, std::max(ty1, ty2));
 	}
 
 	return tmax >= tmin;
-}
\ No newline at end of file
+}
+
+bool Intersections::RayAABB(const Math::v3& min, const Math::v3& max, const Math::v3& origin, const Math::v3& invDirection, r32 tMin, r32 tMax, r32& tEntry) {
+	// NaNs from 0 * inf end up as the second argument of max/min below and get dropped
+	r32 tx1 = (min.x - origin.x) * invDirection.x;
+	r32 tx2 = (max.x - origin.x) * invDirection.x;
+	r32 tmin = std::max(tMin, std::min(tx1, tx2));
+	r32 tmax = std::min(tMax, std::max(tx1, tx2));
+
+	r32 ty1 = (min.y - origin.y) * invDirection.y;
+	r32 ty2 = (max.y - origin.y) * invDirection.y;
+	tmin = std::max(tmin, std::min(ty1, ty2));
+	tmax = std::min(tmax, std::max(ty1, ty2));
+
+	r32 tz1 = (min.z - origin.z) * invDirection.z;
+	r32 tz2 = (max.z - origin.z) * invDirection.z;
+	tmin = std::max(tmin, std::min(tz1, tz2));
+	tmax = std::min(tmax, std::max(tz1, tz2));
+
+	tEntry = tmin;
+	return tmax >= tmin;
+}
+
+bool Intersections::RayTriangle(const Math::Triangle& tri, const Ray& r, r32& t) {
+	Math::v3 ab = tri.B - tri.A;
+	Math::v3 ac = tri.C - tri.A;
+	Math::v3 p = Math::v3::Cross(r.direction, ac);
+	r32 det = Math::v3::Dot(ab, p);
+	if (det == 0) {
+		return false;
+	}
+	r32 invDet = 1.0f / det;
+
+	// written so NaNs from nearly parallel rays fail every test
+	Math::v3 s = r.origin - tri.A;
+	r32 u = Math::v3::Dot(s, p) * invDet;
+	if (!(u >= 0 && u <= 1)) {
+		return false;
+	}
+
+	Math::v3 q = Math::v3::Cross(s, ab);
+	r32 v = Math::v3::Dot(r.direction, q) * invDet;
+	if (!(v >= 0 && u + v <= 1)) {
+		return false;
+	}
+
+	t = Math::v3::Dot(ac, q) * invDet;
+	return t > r.tMin && t < r.tMax;
+}
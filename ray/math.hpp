@@ -4,21 +4,39 @@
 
 #include <cmath>
 #include <iostream>
+#include <limits>
+#include <algorithm>
 
 class Ray;
 
 namespace Random {
-	extern u32 state;
+	// PCG32 (O'Neill 2014), the render threads each make their own per pixel so nothing is shared
+	// and an image only depends on its seed, not on which thread rendered which tile
+	struct PCG {
+		u64 state;
+		u64 increment; // picks one of 2^63 independent sequences, has to be odd
 
-	static u32 Rand(u32& state) {
-		state ^= (state << 13);
-		state ^= (state >> 17);
-		state ^= (state << 5);
-		return state;
-	}
+		PCG(u64 seed, u64 sequence) :state(0), increment((sequence << 1) | 1) {
+			Next();
+			state += seed;
+			Next();
+		}
+
+		u32 Next() {
+			u64 old = state;
+			state = old * 6364136223846793005ull + increment;
+			u32 xorshifted = (u32)(((old >> 18) ^ old) >> 27);
+			u32 rotation = (u32)(old >> 59);
+			return (xorshifted >> rotation) | (xorshifted << ((32 - rotation) & 31));
+		}
+	};
 
-	static u32 Rand() {
-		return Rand(state);
+	// splitmix64 finalizer, neighbouring pixels get unrelated seeds
+	inline static u64 Hash(u64 x) {
+		x += 0x9e3779b97f4a7c15ull;
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+		return x ^ (x >> 31);
 	}
 }
 
@@ -63,7 +81,7 @@ namespace Math {
 
 		v3() :x(0), y(0), z(0) {}
 		v3(r32 x, r32 y, r32 z) :x(x), y(y), z(z) {}
-		v3(const v3& o) :x(o.x), y(o.y), z(o.z) {}
+		v3(const v3& o) = default;
 
 		friend v3 operator-(v3& v) {
 			return v3(-v.x, -v.y, -v.z);
@@ -102,10 +120,10 @@ namespace Math {
 			return v3(xx, yy, zz);
 		}
 
-		static v3 RandUnitCircle() {
-			r32 xx = (r32)Random::Rand() / (r32)std::numeric_limits<u32>::max();
-			r32 yy = (r32)Random::Rand() / (r32)std::numeric_limits<u32>::max();
-			r32 zz = (r32)Random::Rand() / (r32)std::numeric_limits<u32>::max();
+		static v3 RandUnitCircle(Random::PCG& rng) {
+			r32 xx = (r32)rng.Next() / (r32)std::numeric_limits<u32>::max();
+			r32 yy = (r32)rng.Next() / (r32)std::numeric_limits<u32>::max();
+			r32 zz = (r32)rng.Next() / (r32)std::numeric_limits<u32>::max();
 
 			xx = xx * 2 - 1;
 			yy = yy * 2 - 1;
@@ -114,10 +132,10 @@ namespace Math {
 			return v3(xx, yy, zz);
 		}
 
-		static v3 RandUnitCircle(r32 l, r32 r) {
-			r32 xx = (r32)Random::Rand() / (r32)std::numeric_limits<u32>::max();
-			r32 yy = (r32)Random::Rand() / (r32)std::numeric_limits<u32>::max();
-			r32 zz = (r32)Random::Rand() / (r32)std::numeric_limits<u32>::max();
+		static v3 RandUnitCircle(Random::PCG& rng, r32 l, r32 r) {
+			r32 xx = (r32)rng.Next() / (r32)std::numeric_limits<u32>::max();
+			r32 yy = (r32)rng.Next() / (r32)std::numeric_limits<u32>::max();
+			r32 zz = (r32)rng.Next() / (r32)std::numeric_limits<u32>::max();
 
 			xx = xx * 2 - 1;
 			yy = yy * 2 - 1;
@@ -161,12 +179,8 @@ namespace Math {
 			return v3(r.x * l, r.y * l, r.z * l);
 		}
 
-		v3& operator=(const v3& o) {
-			x = o.x;
-			y = o.y;
-			z = o.z;
-			return *this;
-		}
+		// defaulted so nodes holding v3s stay trivially copyable
+		v3& operator=(const v3& o) = default;
 
 		static r32 Project(const v3& a, const v3& b) {
 			return Dot(a, b) / b.Length();
@@ -196,6 +210,17 @@ namespace Math {
 		static v3 Hadamard(const v3& l, const v3& r) {
 			return v3(l.x * r.x, l.y * r.y, l.z * r.z);
 		}
+
+		static v3 Min(const v3& l, const v3& r) {
+			return v3(std::min(l.x, r.x), std::min(l.y, r.y), std::min(l.z, r.z));
+		}
+
+		static v3 Max(const v3& l, const v3& r) {
+			return v3(std::max(l.x, r.x), std::max(l.y, r.y), std::max(l.z, r.z));
+		}
+
+		r32 operator[](int axis) const { return (&x)[axis]; }
+		r32& operator[](int axis) { return (&x)[axis]; }
 	};
 
 	struct Triangle {
@@ -318,6 +343,46 @@ namespace Math {
 		static m3 Identity() {
 			return m3();
 		}
+
+		static m3 FromColumns(const v3& a, const v3& b, const v3& c) {
+			m3 result;
+			for (int row = 0; row < 3; ++row) {
+				result.m[0 + row * 3] = a[row];
+				result.m[1 + row * 3] = b[row];
+				result.m[2 + row * 3] = c[row];
+			}
+			return result;
+		}
+
+		static m3 Transpose(const m3& mat) {
+			m3 result;
+			for (int row = 0; row < 3; ++row) {
+				for (int col = 0; col < 3; ++col) {
+					result.m[col + row * 3] = mat.m[row + col * 3];
+				}
+			}
+			return result;
+		}
+
+		static m3 Inverse(const m3& mat) {
+			const r32* e = mat.m;
+			m3 result;
+			result.m[0 + 0 * 3] = e[4] * e[8] - e[5] * e[7];
+			result.m[1 + 0 * 3] = e[2] * e[7] - e[1] * e[8];
+			result.m[2 + 0 * 3] = e[1] * e[5] - e[2] * e[4];
+			result.m[0 + 1 * 3] = e[5] * e[6] - e[3] * e[8];
+			result.m[1 + 1 * 3] = e[0] * e[8] - e[2] * e[6];
+			result.m[2 + 1 * 3] = e[2] * e[3] - e[0] * e[5];
+			result.m[0 + 2 * 3] = e[3] * e[7] - e[4] * e[6];
+			result.m[1 + 2 * 3] = e[1] * e[6] - e[0] * e[7];
+			result.m[2 + 2 * 3] = e[0] * e[4] - e[1] * e[3];
+
+			r32 determinant = e[0] * result.m[0] + e[1] * result.m[3] + e[2] * result.m[6];
+			for (int i = 0; i < 9; ++i) {
+				result.m[i] /= determinant;
+			}
+			return result;
+		}
 	};
 
 	struct BoundingBox {
@@ -334,6 +399,45 @@ namespace Math {
 			size = max - min;
 		}
 		BoundingBox(const BoundingBox& o) :min(o.min), max(o.max), position(o.position), size(o.size) {}
+		BoundingBox& operator=(const BoundingBox& o) = default;
+
+		// inverted box, anything extended into it becomes the new bounds
+		static BoundingBox Empty() {
+			r32 maxf = std::numeric_limits<r32>::max();
+			return BoundingBox(v3(maxf, maxf, maxf), v3(-maxf, -maxf, -maxf));
+		}
+
+		// false for the inverted Empty() box and for bounds that went inf/NaN
+		bool Valid() const {
+			for (int i = 0; i < 3; ++i) {
+				if (!(min[i] <= max[i]) || !std::isfinite(min[i]) || !std::isfinite(max[i])) {
+					return false;
+				}
+			}
+			return true;
+		}
+
+		void Extend(const v3& p) {
+			min = v3::Min(min, p);
+			max = v3::Max(max, p);
+			position = (min + max) / 2;
+			size = max - min;
+		}
+
+		void Extend(const BoundingBox& b) {
+			min = v3::Min(min, b.min);
+			max = v3::Max(max, b.max);
+			position = (min + max) / 2;
+			size = max - min;
+		}
+
+		r32 SurfaceArea() const {
+			v3 d = max - min;
+			if (d.x < 0 || d.y < 0 || d.z < 0) {
+				return 0;
+			}
+			return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+		}
 
 		friend std::ostream& operator<<(std::ostream& stream, const BoundingBox& box) {
 			std::cout << "[\nmin: " << box.min << "max: " << box.max << "]" << std::endl;
@@ -372,4 +476,9 @@ namespace Intersections {
 	}
 
 	bool RayAABB(Math::BoundingBox b, Ray r);
+	bool RayAABB(const Math::v3& min, const Math::v3& max, const Ray& r);
+	// slab test against a precomputed 1 / direction, clipped to [tMin, tMax], tEntry is only valid when this returns true
+	bool RayAABB(const Math::v3& min, const Math::v3& max, const Math::v3& origin, const Math::v3& invDirection, r32 tMin, r32 tMax, r32& tEntry);
+	// Moller-Trumbore, hits outside the ray's (tMin, tMax) are misses, t is only valid when this returns true
+	bool RayTriangle(const Math::Triangle& tri, const Ray& r, r32& t);
 }
\ No newline at end of file
@@ -1,5 +1,9 @@
 #include "object.hpp"
 #include "scene.hpp"
+#include "bvh.hpp"
+
+#define _USE_MATH_DEFINES
+#include <math.h>
 
 using namespace Math;
 
@@ -41,6 +45,13 @@ void Object::SetEmission(v3 emission) {
     mMaterial.emission = emission;
 }
 
+// the spherical mapping ProcessPixel used to apply to every textured hit
+static void SphericalMapping(v3 normal, r32& u, r32& v) {
+    v3 d = -normal;
+    u = 0.5f + (std::atan2(d.z, d.x) / (2 * M_PI));
+    v = 0.5f + (std::asin(d.y) / M_PI);
+}
+
 bool Plane::IntersectsBox(Math::v3 position, Math::v3 size) {
     v3 max;
     max.x = position.x + size.x / 2.0f;
@@ -58,22 +69,37 @@ bool Plane::IntersectsBox(Math::v3 position, Math::v3 size) {
     return std::abs(s) <= r;
 }
 
-RayPayload Plane::Intersect(const Ray& ray) {
+bool Plane::GetBoundingBox(BoundingBox& /*box*/) {
+    return false;
+}
+
+bool Plane::Intersect(const Ray& ray, HitRecord& hit) {
     r32 dirDot = v3::Dot(ray.direction, mNormal);
     if (dirDot < 0.000000001f && dirDot > 0.000000001f) {
-        return Scene::Miss();
+        return false;
     }
     v3 originToPlane = mPosition - ray.origin;
     float t = v3::Dot(mNormal, originToPlane) / dirDot;
-    if (t >= 0){
-        return Hit(ray, t);
+    if (t > ray.tMin && t < ray.tMax){
+        hit.t = t;
+        hit.object = this;
+        return true;
     }
-    return Scene::Miss();
+    return false;
 }
 
-RayPayload Plane::Hit(const Ray& ray, r32 t) {
+bool Plane::Occluded(const Ray& ray) {
+    r32 dirDot = v3::Dot(ray.direction, mNormal);
+    v3 originToPlane = mPosition - ray.origin;
+    // parallel rays give inf or NaN here, both fail the compare
+    float t = v3::Dot(mNormal, originToPlane) / dirDot;
+    return t > ray.tMin && t < ray.tMax;
+}
+
+RayPayload Plane::Hit(const Ray& ray, const HitRecord& hit) {
     RayPayload result = {};
 
+    r32 t = hit.t;
     v3 intersectionPoint = ray.origin + ray.direction * t;
     v3 normal = mNormal;
     normal = normal.Normalized();
@@ -82,6 +108,9 @@ RayPayload Plane::Hit(const Ray& ray, r32 t) {
     result.closestDistance = t;
     result.position = intersectionPoint;
     result.normal = normal;
+    if (mMaterial.hasAlbedoTexture) {
+        SphericalMapping(normal, result.u, result.v);
+    }
 
     return result;
 }
@@ -112,30 +141,54 @@ bool Sphere::IntersectsBox(Math::v3 position, Math::v3 size) {
     return dmin <= r2;
 }
 
-RayPayload Sphere::Intersect(const Ray& ray) {
-    v3 o = ray.origin - mPosition;
+bool Sphere::GetBoundingBox(BoundingBox& box) {
+    box = BoundingBox(mPosition - mRadius, mPosition + mRadius);
+    return true;
+}
+
+// the nearest of the two roots inside the ray's interval
+static bool SphereRoot(const Ray& ray, v3 center, r32 radius, r32& t) {
+    v3 o = ray.origin - center;
 
     r32 a = v3::Dot(ray.direction, ray.direction);
     r32 b = 2 * v3::Dot(o, ray.direction);
-    r32 c = v3::Dot(o, o) - mRadius * mRadius;
+    r32 c = v3::Dot(o, o) - radius * radius;
 
     r32 delta = b * b - 4 * a * c;
+    if (delta < 0) {
+        return false;
+    }
+
     r32 cd = std::sqrt(delta);
-    if (delta >= 0) {
-        r32 t = (-b - cd) / (2 * a);
-        if (t <= 0) {
-            return Scene::Miss();
-        }
+    t = (-b - cd) / (2 * a);
+    if (t > ray.tMin && t < ray.tMax) {
+        return true;
+    }
+    // the far side, rays starting inside the sphere
+    t = (-b + cd) / (2 * a);
+    return t > ray.tMin && t < ray.tMax;
+}
 
-        return Hit(ray, t);
+bool Sphere::Intersect(const Ray& ray, HitRecord& hit) {
+    r32 t;
+    if (SphereRoot(ray, mPosition, mRadius, t)) {
+        hit.t = t;
+        hit.object = this;
+        return true;
     }
 
-    return Scene::Miss();
+    return false;
 }
 
-RayPayload Sphere::Hit(const Ray& ray, r32 t) {
+bool Sphere::Occluded(const Ray& ray) {
+    r32 t;
+    return SphereRoot(ray, mPosition, mRadius, t);
+}
+
+RayPayload Sphere::Hit(const Ray& ray, const HitRecord& hit) {
     RayPayload result = {};
 
+    r32 t = hit.t;
     v3 intersectionPoint = ray.origin + ray.direction * t;
     v3 normal = intersectionPoint - mPosition;
     normal = normal.Normalized();
@@ -144,120 +197,97 @@ RayPayload Sphere::Hit(const Ray& ray, r32 t) {
     result.closestDistance = t;
     result.position = intersectionPoint;
     result.normal = normal;
+    if (mMaterial.hasAlbedoTexture) {
+        SphericalMapping(normal, result.u, result.v);
+    }
 
     return result;
 }
 
-TriangleArray::TriangleArray(const std::vector<Triangle>& triangles) : mTriangles(triangles) {
+TriangleArray::TriangleArray(const std::vector<v3>& vertices, const std::vector<u32>& indices) : mBVH(nullptr), mVertices(vertices), mIndices(indices) {
     mIsMesh = true;
+    NormalizeWinding();
 }
 
-RayPayload TriangleArray::Intersect(const Ray& ray, const std::vector<Triangle*>& triangles) {
-    RayPayload closestPayload;
-    closestPayload.closestDistance = std::numeric_limits<float>::max();
+TriangleArray::TriangleArray(const std::vector<Triangle>& triangles) : mBVH(nullptr) {
+    mIsMesh = true;
+    mVertices.reserve(triangles.size() * 3);
+    mIndices.reserve(triangles.size() * 3);
+    for (auto& tri : triangles) {
+        mIndices.push_back((u32)mVertices.size());
+        mVertices.push_back(tri.A);
+        mIndices.push_back((u32)mVertices.size());
+        mVertices.push_back(tri.B);
+        mIndices.push_back((u32)mVertices.size());
+        mVertices.push_back(tri.C);
+    }
+    NormalizeWinding();
+}
 
-    for (auto& tri: triangles) {
-        v3 AB = tri->B - tri->A;
-        v3 AC = tri->C - tri->A;
-
-        v3 normal = v3::Cross(AB, AC);
-        if (normal.z > 0) {
-            v3 aux = tri->C;
-            tri->C = tri->B;
-            tri->B = aux;
-
-            AB = tri->B - tri->A;
-            AC = tri->C - tri->A;
-            normal = v3::Cross(AB, AC);
+void TriangleArray::NormalizeWinding() {
+    for (u32 i = 0; i < TriangleCount(); ++i) {
+        Triangle tri = GetTriangle(i);
+        if (v3::Cross(tri.B - tri.A, tri.C - tri.A).z > 0) {
+            std::swap(mIndices[i * 3 + 1], mIndices[i * 3 + 2]);
         }
+    }
+}
 
-        r32 dirDot = v3::Dot(ray.direction, normal);
-        if (dirDot < 0.000000001f && dirDot > 0.000000001f) {
-            return Scene::Miss();
-        }
-        v3 originToOnePoint = tri->A - ray.origin;
-        float t = v3::Dot(normal, originToOnePoint) / dirDot;
-        if (t >= 0) {
-
-            // Triangle check
-            v3 point = (ray.origin + ray.direction * t);
-
-            v3 v00 = tri->B - tri->A;
-            v3 v01 = tri->C - tri->A;
-            v3 v02 = point - tri->A;
-
-            r32 d00 = v3::Dot(v00, v00);
-            r32 d01 = v3::Dot(v00, v01);
-            r32 d11 = v3::Dot(v01, v01);
-            r32 d20 = v3::Dot(v02, v00);
-            r32 d21 = v3::Dot(v02, v01);
-            r32 denom = d00 * d11 - d01 * d01;
-            r32 v = (d11 * d20 - d01 * d21) / denom;
-            r32 w = (d00 * d21 - d01 * d20) / denom;
-            r32 u = 1.0f - v - w;
-
-            if (u >= 0 && v >= 0 && w >= 0) {
-                if (t < closestPayload.closestDistance) {
-                    closestPayload = Hit(ray, t, normal, point);
-                }
-            }
-        }
+void TriangleArray::BuildBVH() {
+    BuildBVH(BVHBuildSettings());
+}
+
+void TriangleArray::BuildBVH(const BVHBuildSettings& settings) {
+    delete mBVH;
+    mBVH = new BVH(BVH::BuildFromMesh(this, settings));
+    if (mBVH->mNodes.size()) {
+        mBoundingBox = BoundingBox(mBVH->mNodes[0].min, mBVH->mNodes[0].max);
     }
-    if (closestPayload.closestDistance != std::numeric_limits<float>::max()) {
-        return closestPayload;
+}
+
+bool TriangleArray::Intersect(const Ray& ray, const std::vector<u32>& triangles, HitRecord& hit) {
+    Ray r = ray;
+    bool found = false;
+
+    for (auto& tri: triangles) {
+        if (IntersectTriangle(r, tri, hit)) {
+            r.tMax = hit.t;
+            found = true;
+        }
     }
-    return Scene::Miss();
+    return found;
 }
 
-RayPayload TriangleArray::Intersect(const Ray& ray) {
-    RayPayload closestPayload;
-    closestPayload.closestDistance = std::numeric_limits<float>::max();
+bool TriangleArray::IntersectTriangle(const Ray& ray, u32 index, HitRecord& hit) {
+    r32 t;
+    if (Intersections::RayTriangle(GetTriangle(index), ray, t)) {
+        hit.t = t;
+        hit.object = this;
+        hit.primitive = index;
+        return true;
+    }
+    return false;
+}
 
-    for (auto& triangle: mTriangles) {
-        v3 AB = triangle.B - triangle.A;
-        v3 AC = triangle.C - triangle.A;
+bool TriangleArray::Intersect(const Ray& ray, HitRecord& hit) {
+    TraceStats stats;
+    return Intersect(ray, hit, stats);
+}
 
-        v3 normal = v3::Cross(AB, AC);
-        if (normal.z > 0) {
-            v3 aux = triangle.C;
-            triangle.C = triangle.B;
-            triangle.B = aux;
+bool TriangleArray::Intersect(const Ray& ray, HitRecord& hit, TraceStats& stats) {
+    Ray r = ray;
 
-            AB = triangle.B - triangle.A;
-            AC = triangle.C - triangle.A;
-            normal = v3::Cross(AB, AC);
-        }
+    if (mBVH) {
+        return mBVH->Intersect(r, hit, stats);
+    }
 
-        r32 dirDot = v3::Dot(ray.direction, normal);
-        if (dirDot < 0.000000001f && dirDot > 0.000000001f) {
-            return Scene::Miss();
+    bool found = false;
+    for (u32 i = 0; i < TriangleCount(); ++i) {
+        ++stats.trianglesTested;
+        if (IntersectTriangle(r, i, hit)) {
+            r.tMax = hit.t;
+            found = true;
         }
-        v3 originToOnePoint = triangle.A - ray.origin;
-        float t = v3::Dot(normal, originToOnePoint) / dirDot;
-        if (t >= 0) {
-
-            // Triangle check
-            v3 point = (ray.origin + ray.direction * t);
-
-            v3 v00 = triangle.B - triangle.A;
-            v3 v01 = triangle.C - triangle.A;
-            v3 v02 = point - triangle.A;
-
-            r32 d00 = v3::Dot(v00, v00);
-            r32 d01 = v3::Dot(v00, v01);
-            r32 d11 = v3::Dot(v01, v01);
-            r32 d20 = v3::Dot(v02, v00);
-            r32 d21 = v3::Dot(v02, v01);
-            r32 denom = d00 * d11 - d01 * d01;
-            r32 v = (d11 * d20 - d01 * d21) / denom;
-            r32 w = (d00 * d21 - d01 * d20) / denom;
-            r32 u = 1.0f - v - w;
-
-            if (u >= 0 && v >= 0 && w >= 0) {
-                if (t < closestPayload.closestDistance) {
-                    closestPayload = Hit(ray, t, normal, point);
-                }
-            }
             // Bad barycentric coordinate implementation below, kept for debugging later
 #if 0
             v3 BC = (triangle.C - triangle.B);
@@ -301,54 +331,59 @@ RayPayload TriangleArray::Intersect(const Ray& ray) {
             }
 #endif
             //
-        }
     }
-    if (closestPayload.closestDistance != std::numeric_limits<float>::max()) {
-        return closestPayload;
-    }
-    return Scene::Miss();
+    return found;
 };
 
-RayPayload TriangleArray::Hit(const Ray& ray, r32 t, v3 normal, v3 point) {
+bool TriangleArray::Occluded(const Ray& ray) {
+    TraceStats stats;
+    return Occluded(ray, stats);
+}
+
+bool TriangleArray::Occluded(const Ray& ray, TraceStats& stats) {
+    if (mBVH) {
+        return mBVH->Occluded(ray, stats);
+    }
+
+    for (u32 i = 0; i < TriangleCount(); ++i) {
+        ++stats.trianglesTested;
+        r32 t;
+        if (Intersections::RayTriangle(GetTriangle(i), ray, t)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+RayPayload TriangleArray::Hit(const Ray& ray, const HitRecord& hit) {
     RayPayload p;
-    p.closestDistance = t;
+    p.closestDistance = hit.t;
     p.closestHit = this;
-    p.normal = normal;
-    p.position = point;
+    // only the winning triangle is looked at again
+    Triangle tri = GetTriangle(hit.primitive);
+    p.normal = v3::Cross(tri.B - tri.A, tri.C - tri.A).Normalized();
+    p.position = ray.origin + ray.direction * hit.t;
+    if (mMaterial.hasAlbedoTexture) {
+        SphericalMapping(p.normal, p.u, p.v);
+    }
     return p;
 }
 
 void TriangleArray::ComputeBoundingBox(){
     r32 maxf = std::numeric_limits<float>::max();
-    r32 minf = std::numeric_limits<float>::min();
+    r32 minf = std::numeric_limits<float>::lowest();
 
     v3 min(maxf, maxf, maxf);
     v3 max(minf, minf, minf);
 
-    for (const auto& triangle : mTriangles) {
-        min.x = std::min(min.x, triangle.A.x);
-        min.y = std::min(min.y, triangle.A.y);
-        min.z = std::min(min.z, triangle.A.z);
-
-        min.x = std::min(min.x, triangle.B.x);
-        min.y = std::min(min.y, triangle.B.y);
-        min.z = std::min(min.z, triangle.B.z);
-
-        min.x = std::min(min.x, triangle.C.x);
-        min.y = std::min(min.y, triangle.C.y);
-        min.z = std::min(min.z, triangle.C.z);
-
-        max.x = std::max(max.x, triangle.A.x);
-        max.y = std::max(max.y, triangle.A.y);
-        max.z = std::max(max.z, triangle.A.z);
+    for (const auto& vertex : mVertices) {
+        min.x = std::min(min.x, vertex.x);
+        min.y = std::min(min.y, vertex.y);
+        min.z = std::min(min.z, vertex.z);
 
-        max.x = std::max(max.x, triangle.B.x);
-        max.y = std::max(max.y, triangle.B.y);
-        max.z = std::max(max.z, triangle.B.z);
-
-        max.x = std::max(max.x, triangle.C.x);
-        max.y = std::max(max.y, triangle.C.y);
-        max.z = std::max(max.z, triangle.C.z);
+        max.x = std::max(max.x, vertex.x);
+        max.y = std::max(max.y, vertex.y);
+        max.z = std::max(max.z, vertex.z);
     }
     mBoundingBox = BoundingBox(min, max);
     std::cout << mBoundingBox;
@@ -363,11 +398,17 @@ bool TriangleArray::IntersectsBox(Math::v3 position, Math::v3 size) {
     return false;
 }
 
+bool TriangleArray::GetBoundingBox(BoundingBox& box) {
+    box = mBoundingBox;
+    return true;
+}
+
 #include "tribox.hpp"
-std::vector<Triangle*> TriangleArray::IntersectedTriangles(Math::v3 position, Math::v3 size) {
-    std::vector<Triangle*> result;
+std::vector<u32> TriangleArray::IntersectedTriangles(Math::v3 position, Math::v3 size) {
+    std::vector<u32> result;
 
-    for (auto& t : mTriangles) {
+    for (u32 i = 0; i < TriangleCount(); ++i) {
+        Triangle t = GetTriangle(i);
         r32 verts[3][3] = {
             {t.A.x, t.A.y, t.A.z},
             {t.B.x, t.B.y, t.B.z},
@@ -379,7 +420,7 @@ std::vector<Triangle*> TriangleArray::IntersectedTriangles(Math::v3 position, Ma
         bool intersected = triBoxOverlap(c, hs, verts) == 1;
 
         if (intersected) {
-            result.push_back(&t);
+            result.push_back(i);
         }
     }
 
@@ -387,18 +428,21 @@ std::vector<Triangle*> TriangleArray::IntersectedTriangles(Math::v3 position, Ma
 }
 
 void TriangleArray::PushTransforms() {
-    for (auto& triangle : mTriangles) {
-        triangle.A = mRotation * triangle.A;
-        triangle.B = mRotation * triangle.B;
-        triangle.C = mRotation * triangle.C;
-
-        triangle.A = mScale * triangle.A;
-        triangle.B = mScale * triangle.B;
-        triangle.C = mScale * triangle.C;
-
-        triangle.A += mTranslate;
-        triangle.B += mTranslate;
-        triangle.C += mTranslate;
+    // once per shared vertex, not per corner
+    for (auto& vertex : mVertices) {
+        vertex = mRotation * vertex;
+        vertex = mScale * vertex;
+        vertex += mTranslate;
+    }
+    // rotations can turn a triangle around
+    NormalizeWinding();
+
+    if (mBVH) {
+        mBVH->MarkAllDirty();
+        mBVH->Update();
+        if (mBVH->mNodes.size()) {
+            mBoundingBox = BoundingBox(mBVH->mNodes[0].min, mBVH->mNodes[0].max);
+        }
     }
 }
 
@@ -407,16 +451,24 @@ Cube::Cube(Math::v3 position, Math::v3 size) : Object(position), mSize(size){
 
 bool Cube::IntersectsBox(Math::v3 position, Math::v3 size) { return true; }
 
-RayPayload Cube::Intersect(const Ray& r) {
+bool Cube::GetBoundingBox(BoundingBox& box) {
+    box = BoundingBox(mPosition - (mSize / 2), mPosition + (mSize / 2));
+    return true;
+}
+
+bool Cube::Slabs(const Ray& r, r32& t) {
     r32 tmin = std::numeric_limits<r32>::min();
     r32 tmax = std::numeric_limits<r32>::max();
-    BoundingBox b(mPosition - (mSize / 2), mPosition - (mSize / 2));
+    BoundingBox b(mPosition - (mSize / 2), mPosition + (mSize / 2));
     if (r.direction.x != 0.0) {
         r32 tx1 = (b.min.x - r.origin.x) / r.direction.x;
         r32 tx2 = (b.max.x - r.origin.x) / r.direction.x;
 
         tmin = std::max(tmin, std::min(tx1, tx2));
         tmax = std::min(tmax, std::max(tx1, tx2));
+    } else if (r.origin.x < b.min.x || r.origin.x > b.max.x) {
+        // parallel to the slab and outside of it
+        return false;
     }
 
     if (r.direction.y != 0.0) {
@@ -425,6 +477,8 @@ RayPayload Cube::Intersect(const Ray& r) {
 
         tmin = std::max(tmin, std::min(ty1, ty2));
         tmax = std::min(tmax, std::max(ty1, ty2));
+    } else if (r.origin.y < b.min.y || r.origin.y > b.max.y) {
+        return false;
     }
 
     if (r.direction.z != 0.0) {
@@ -433,18 +487,34 @@ RayPayload Cube::Intersect(const Ray& r) {
 
         tmin = std::max(tmin, std::min(ty1, ty2));
         tmax = std::min(tmax, std::max(ty1, ty2));
+    } else if (r.origin.z < b.min.z || r.origin.z > b.max.z) {
+        return false;
     }
 
-    if (tmax >= tmin) {
-        return Hit(r, tmin);
+    t = tmin;
+    return tmax >= tmin && tmin > r.tMin && tmin < r.tMax;
+}
+
+bool Cube::Intersect(const Ray& r, HitRecord& hit) {
+    r32 t;
+    if (Slabs(r, t)) {
+        hit.t = t;
+        hit.object = this;
+        return true;
     }
 
-    return Scene::Miss();
+    return false;
 }
 
-RayPayload Cube::Hit(const Ray& ray, r32 t) {
+bool Cube::Occluded(const Ray& ray) {
+    r32 t;
+    return Slabs(ray, t);
+}
+
+RayPayload Cube::Hit(const Ray& ray, const HitRecord& hit) {
     RayPayload result = {};
 
+    r32 t = hit.t;
     v3 intersectionPoint = ray.origin + ray.direction * t;
     v3 normal = intersectionPoint - mPosition;
 #if 0
@@ -458,7 +528,93 @@ RayPayload Cube::Hit(const Ray& ray, r32 t) {
     result.closestDistance = t;
     result.position = intersectionPoint;
     result.normal = normal;
+    if (mMaterial.hasAlbedoTexture) {
+        SphericalMapping(normal, result.u, result.v);
+    }
 
     return result;
 }
 
+MeshInstance::MeshInstance(TriangleArray* mesh) : mMesh(mesh) {
+}
+
+bool MeshInstance::IntersectsBox(Math::v3 position, Math::v3 size) {
+    BoundingBox b(position - (size / 2.0), position + (size / 2.0));
+    return Intersections::AABB(mBoundingBox, b);
+}
+
+bool MeshInstance::GetBoundingBox(BoundingBox& box) {
+    box = mBoundingBox;
+    return true;
+}
+
+void MeshInstance::PushTransforms() {
+    if (!mMesh->mBVH) {
+        mMesh->BuildBVH();
+    }
+
+    // same order TriangleArray::PushTransforms bakes in, rotate, scale, then translate
+    mToWorld = m3::FromColumns(
+        mScale * (mRotation * v3(1, 0, 0)),
+        mScale * (mRotation * v3(0, 1, 0)),
+        mScale * (mRotation * v3(0, 0, 1)));
+    mToObject = m3::Inverse(mToWorld);
+    mNormalToWorld = m3::Transpose(mToObject);
+
+    mBoundingBox = BoundingBox::Empty();
+    // transforming the inverted Empty() corners gives inf/NaN bounds, an empty mesh stays empty so the TLAS skips it
+    if (mMesh->TriangleCount() == 0) {
+        return;
+    }
+
+    const BoundingBox& local = mMesh->mBoundingBox;
+    for (int i = 0; i < 8; ++i) {
+        v3 corner((i & 1) ? local.max.x : local.min.x,
+            (i & 2) ? local.max.y : local.min.y,
+            (i & 4) ? local.max.z : local.min.z);
+        mBoundingBox.Extend(mToWorld * corner + mTranslate);
+    }
+}
+
+bool MeshInstance::Intersect(const Ray& ray, HitRecord& hit) {
+    TraceStats stats;
+    return Intersect(ray, hit, stats);
+}
+
+bool MeshInstance::Intersect(const Ray& ray, HitRecord& hit, TraceStats& stats) {
+    // the direction is left unnormalized so t and the ray's interval mean the same thing in both spaces
+    Ray local = ray;
+    local.origin = mToObject * (ray.origin - mTranslate);
+    local.direction = mToObject * ray.direction;
+
+    if (!mMesh->Intersect(local, hit, stats)) {
+        return false;
+    }
+    hit.object = this;
+    return true;
+}
+
+RayPayload MeshInstance::Hit(const Ray& ray, const HitRecord& hit) {
+    RayPayload p;
+    p.closestDistance = hit.t;
+    p.closestHit = this;
+    p.position = ray.origin + ray.direction * hit.t;
+    Triangle tri = mMesh->GetTriangle(hit.primitive);
+    p.normal = (mNormalToWorld * v3::Cross(tri.B - tri.A, tri.C - tri.A)).Normalized();
+    if (mMaterial.hasAlbedoTexture) {
+        SphericalMapping(p.normal, p.u, p.v);
+    }
+    return p;
+}
+
+bool MeshInstance::Occluded(const Ray& ray) {
+    TraceStats stats;
+    return Occluded(ray, stats);
+}
+
+bool MeshInstance::Occluded(const Ray& ray, TraceStats& stats) {
+    Ray local = ray;
+    local.origin = mToObject * (ray.origin - mTranslate);
+    local.direction = mToObject * ray.direction;
+    return mMesh->Occluded(local, stats);
+}
@@ -10,6 +10,9 @@
 #include "material.hpp"
 #include "ray.hpp"
 
+class BVH;
+struct BVHBuildSettings;
+
 class Object {
 public:
     Math::v3 mPosition;
@@ -23,6 +26,7 @@ public:
 
     Object();
     Object(Math::v3 position);
+    virtual ~Object() = default;
 
     void SetRotation(const Math::m3& rotation);
     void SetScale(const Math::m3& scale);
@@ -33,8 +37,14 @@ public:
     void SetAlbedoTexture(Texture* texture);
 
     virtual bool IntersectsBox(Math::v3 position, Math::v3 size) = 0;
-    virtual RayPayload Intersect(const Ray& ray) = 0;
-    virtual RayPayload Hit(const Ray& ray, r32 t) = 0;
+    // returns false for unbounded objects (planes), those stay out of the BVH
+    virtual bool GetBoundingBox(Math::BoundingBox& box) = 0;
+    // nearest hit inside the ray's interval, hit is only written when this returns true
+    virtual bool Intersect(const Ray& ray, HitRecord& hit) = 0;
+    // any hit inside the ray's interval, stops at the first one
+    virtual bool Occluded(const Ray& ray) = 0;
+    // normal, position and texture coordinates, only for the hit that ends up closest
+    virtual RayPayload Hit(const Ray& ray, const HitRecord& hit) = 0;
 };
 
 class MeshObject : public Object {
@@ -45,7 +55,8 @@ public:
     // shouldn't be virtual, but for the sake of cleanness, I will implement this
     // in the triangle array class
     // TODO make the mesh object the only class, no Triangle Array class
-    virtual std::vector<Math::Triangle*> IntersectedTriangles(Math::v3 position, Math::v3 size) = 0;
+    // indices of the triangles touching the box
+    virtual std::vector<u32> IntersectedTriangles(Math::v3 position, Math::v3 size) = 0;
 };
 
 class Plane : public Object {
@@ -54,8 +65,10 @@ public:
     Plane(Math::v3 position, Math::v3 normal) : Object(position), mNormal(normal) {}
 
     bool IntersectsBox(Math::v3 position, Math::v3 size) override;
-    RayPayload Intersect(const Ray& ray) override;
-    RayPayload Hit(const Ray& ray, r32 t) override;
+    bool GetBoundingBox(Math::BoundingBox& box) override;
+    bool Intersect(const Ray& ray, HitRecord& hit) override;
+    bool Occluded(const Ray& ray) override;
+    RayPayload Hit(const Ray& ray, const HitRecord& hit) override;
 };
 
 class Sphere : public Object {
@@ -64,9 +77,11 @@ public:
     Sphere(Math::v3 position, r32 radius);
 
     bool IntersectsBox(Math::v3 position, Math::v3 size);
+    bool GetBoundingBox(Math::BoundingBox& box) override;
 
-    RayPayload Intersect(const Ray& ray) override;
-    RayPayload Hit(const Ray& ray, r32 t) override;
+    bool Intersect(const Ray& ray, HitRecord& hit) override;
+    bool Occluded(const Ray& ray) override;
+    RayPayload Hit(const Ray& ray, const HitRecord& hit) override;
 };
 
 class Cube : public Object {
@@ -74,27 +89,78 @@ public:
     Math::v3 mSize;
     Cube(Math::v3 position, Math::v3 size);
 
+    // entry distance along the ray when it lies in the ray's interval, shared by Intersect and Occluded
+    bool Slabs(const Ray& ray, r32& t);
+
     bool IntersectsBox(Math::v3 position, Math::v3 size);
+    bool GetBoundingBox(Math::BoundingBox& box) override;
 
-    RayPayload Intersect(const Ray& ray) override;
-    RayPayload Hit(const Ray& ray, r32 t) override;
+    bool Intersect(const Ray& ray, HitRecord& hit) override;
+    bool Occluded(const Ray& ray) override;
+    RayPayload Hit(const Ray& ray, const HitRecord& hit) override;
 };
 
-class TriangleArray : public MeshObject {
+// final so the BVH leaves can call into meshes and instances without going through the vtable
+class TriangleArray final : public MeshObject {
 public:
-    // BVH* bvh;
+    BVH* mBVH;
     Math::BoundingBox mBoundingBox;
-    std::vector<Math::Triangle> mTriangles;
+    // shared corners, 3 indices per triangle
+    std::vector<Math::v3> mVertices;
+    std::vector<u32> mIndices;
+    TriangleArray(const std::vector<Math::v3>& vertices, const std::vector<u32>& indices);
+    // every corner becomes its own vertex, prefer the indexed constructor for big meshes
     TriangleArray(const std::vector<Math::Triangle>& triangles);
 
-    void ComputeBoundingBox();
+    u32 TriangleCount() const { return (u32)(mIndices.size() / 3); }
+    Math::Triangle GetTriangle(u32 index) const {
+        return Math::Triangle(mVertices[mIndices[index * 3]], mVertices[mIndices[index * 3 + 1]], mVertices[mIndices[index * 3 + 2]]);
+    }
 
-    std::vector<Math::Triangle*> IntersectedTriangles(Math::v3 position, Math::v3 size) override;
+    void ComputeBoundingBox();
+    // swaps B and C where needed so every normal faces -z, once whenever the triangles change,
+    // intersection only ever reads the geometry so the render threads can share it
+    void NormalizeWinding();
+    // bottom level BVH over the triangles, Intersect goes through it once built
+    void BuildBVH();
+    void BuildBVH(const BVHBuildSettings& settings);
+
+    std::vector<u32> IntersectedTriangles(Math::v3 position, Math::v3 size) override;
     bool IntersectsBox(Math::v3 position, Math::v3 size);
+    bool GetBoundingBox(Math::BoundingBox& box) override;
+
+    void PushTransforms();
+    bool Intersect(const Ray& ray, const std::vector<u32>& triangles, HitRecord& hit);
+    bool IntersectTriangle(const Ray& ray, u32 index, HitRecord& hit);
+    bool Intersect(const Ray& ray, HitRecord& hit) override;
+    bool Occluded(const Ray& ray) override;
+    // what the top level BVH calls, stats picks up the bottom level traversal
+    bool Intersect(const Ray& ray, HitRecord& hit, TraceStats& stats);
+    bool Occluded(const Ray& ray, TraceStats& stats);
+    RayPayload Hit(const Ray& ray, const HitRecord& hit) override;
+};
+
+// places a TriangleArray in the scene without copying its triangles,
+// rays are moved into the mesh's space and walk its bottom level BVH
+class MeshInstance final : public Object {
+public:
+    TriangleArray* mMesh;
+    Math::BoundingBox mBoundingBox;
+    Math::m3 mToWorld;
+    Math::m3 mToObject;
+    Math::m3 mNormalToWorld;
+
+    MeshInstance(TriangleArray* mesh);
+
+    bool IntersectsBox(Math::v3 position, Math::v3 size) override;
+    bool GetBoundingBox(Math::BoundingBox& box) override;
 
+    // caches the inverse transform and the world bounds, call after changing the transform
     void PushTransforms();
-    RayPayload Intersect(const Ray& ray, const std::vector<Math::Triangle*>& triangles);
-    RayPayload Intersect(const Ray& ray) override;
-    RayPayload Hit(const Ray& ray, r32 t, Math::v3 normal, Math::v3 point);
-    RayPayload Hit(const Ray& ray, r32 t) override { return RayPayload(); }
+    // the hit keeps the mesh's triangle, object becomes the instance
+    bool Intersect(const Ray& ray, HitRecord& hit) override;
+    bool Occluded(const Ray& ray) override;
+    bool Intersect(const Ray& ray, HitRecord& hit, TraceStats& stats);
+    bool Occluded(const Ray& ray, TraceStats& stats);
+    RayPayload Hit(const Ray& ray, const HitRecord& hit) override;
 };
@@ -0,0 +1,356 @@
+#include "primitives.hpp"
+#include "object.hpp"
+
+#include <immintrin.h>
+
+using namespace Math;
+
+u32 SphereArray::Add(Sphere* sphere) {
+	objects.push_back(sphere);
+	centerX.push_back(0);
+	centerY.push_back(0);
+	centerZ.push_back(0);
+	radius2.push_back(0);
+	Copy(Size() - 1);
+	return Size() - 1;
+}
+
+void SphereArray::Copy(u32 slot) {
+	centerX[slot] = objects[slot]->mPosition.x;
+	centerY[slot] = objects[slot]->mPosition.y;
+	centerZ[slot] = objects[slot]->mPosition.z;
+	radius2[slot] = objects[slot]->mRadius * objects[slot]->mRadius;
+}
+
+void SphereArray::Update() {
+	for (u32 i = 0; i < Size(); ++i) {
+		Copy(i);
+	}
+}
+
+#if defined(__AVX2__)
+// roots of the 8 spheres from first on, the near one unless it's in front of tMin like Sphere::Intersect.
+// Lanes from count on, misses and roots outside the ray's interval come back as infinity
+static __m256 SphereRoots(const SphereArray& spheres, u32 first, u32 count, const Ray& ray, __m256 a, __m256 invA) {
+	__m256 dx = _mm256_set1_ps(ray.direction.x);
+	__m256 dy = _mm256_set1_ps(ray.direction.y);
+	__m256 dz = _mm256_set1_ps(ray.direction.z);
+	__m256 inf = _mm256_set1_ps(std::numeric_limits<r32>::infinity());
+
+	// a short run at the end of the table would read past it, masked lanes load zeros instead
+#if defined(__AVX512F__) && defined(__AVX512VL__)
+	__mmask8 lanes = (__mmask8)((1u << count) - 1);
+	__m256 cx = _mm256_maskz_loadu_ps(lanes, &spheres.centerX[first]);
+	__m256 cy = _mm256_maskz_loadu_ps(lanes, &spheres.centerY[first]);
+	__m256 cz = _mm256_maskz_loadu_ps(lanes, &spheres.centerZ[first]);
+	__m256 r2 = _mm256_maskz_loadu_ps(lanes, &spheres.radius2[first]);
+#else
+	__m256i lanes = _mm256_cmpgt_epi32(_mm256_set1_epi32((int)count), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+	__m256 cx = _mm256_maskload_ps(&spheres.centerX[first], lanes);
+	__m256 cy = _mm256_maskload_ps(&spheres.centerY[first], lanes);
+	__m256 cz = _mm256_maskload_ps(&spheres.centerZ[first], lanes);
+	__m256 r2 = _mm256_maskload_ps(&spheres.radius2[first], lanes);
+#endif
+
+	__m256 ox = _mm256_sub_ps(_mm256_set1_ps(ray.origin.x), cx);
+	__m256 oy = _mm256_sub_ps(_mm256_set1_ps(ray.origin.y), cy);
+	__m256 oz = _mm256_sub_ps(_mm256_set1_ps(ray.origin.z), cz);
+	// half of b, the 2s and 4 cancel
+	__m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ox, dx), _mm256_mul_ps(oy, dy)), _mm256_mul_ps(oz, dz));
+	__m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ox, ox), _mm256_mul_ps(oy, oy)), _mm256_mul_ps(oz, oz)), r2);
+	__m256 delta = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(a, c));
+
+	__m256 zero = _mm256_setzero_ps();
+	__m256 nearT = _mm256_set1_ps(ray.tMin);
+	__m256 farT = _mm256_set1_ps(ray.tMax);
+	// the square root only runs when one of them is hit at all
+#if defined(__AVX512F__) && defined(__AVX512VL__)
+	__mmask8 hits = _mm256_mask_cmp_ps_mask(lanes, delta, zero, _CMP_GE_OQ);
+	if (!hits) {
+		return inf;
+	}
+#else
+	__m256 hits = _mm256_and_ps(_mm256_castsi256_ps(lanes), _mm256_cmp_ps(delta, zero, _CMP_GE_OQ));
+	if (!_mm256_movemask_ps(hits)) {
+		return inf;
+	}
+#endif
+
+	__m256 cd = _mm256_sqrt_ps(delta);
+	__m256 tNear = _mm256_mul_ps(_mm256_sub_ps(zero, _mm256_add_ps(b, cd)), invA);
+	__m256 tFar = _mm256_mul_ps(_mm256_sub_ps(cd, b), invA);
+#if defined(__AVX512F__) && defined(__AVX512VL__)
+	__m256 t = _mm256_mask_blend_ps(_mm256_cmp_ps_mask(tNear, nearT, _CMP_GT_OQ), tFar, tNear);
+	hits = _mm256_mask_cmp_ps_mask(hits, t, nearT, _CMP_GT_OQ);
+	hits = _mm256_mask_cmp_ps_mask(hits, t, farT, _CMP_LT_OQ);
+	return _mm256_mask_blend_ps(hits, inf, t);
+#else
+	__m256 t = _mm256_blendv_ps(tFar, tNear, _mm256_cmp_ps(tNear, nearT, _CMP_GT_OQ));
+	hits = _mm256_and_ps(hits, _mm256_cmp_ps(t, nearT, _CMP_GT_OQ));
+	hits = _mm256_and_ps(hits, _mm256_cmp_ps(t, farT, _CMP_LT_OQ));
+	return _mm256_blendv_ps(inf, t, hits);
+#endif
+}
+
+// 8 spheres per step, ray.tMax shrinks between steps so the later ones only have to beat the best so far
+bool SphereArray::Intersect(u32 first, u32 last, Ray& ray, HitRecord& hit) const {
+	r32 dd = v3::Dot(ray.direction, ray.direction);
+	__m256 a = _mm256_set1_ps(dd);
+	__m256 invA = _mm256_set1_ps(1.0f / dd);
+
+	u32 best = last;
+	for (u32 i = first; i < last; i += 8) {
+		__m256 t = SphereRoots(*this, i, std::min(last - i, 8u), ray, a, invA);
+
+		// horizontal min, then the first lane holding it
+		__m256 m = _mm256_min_ps(t, _mm256_permute2f128_ps(t, t, 1));
+		m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+		m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+		r32 nearest = _mm_cvtss_f32(_mm256_castps256_ps128(m));
+		if (nearest == std::numeric_limits<r32>::infinity()) {
+			continue;
+		}
+
+		u32 mask = (u32)_mm256_movemask_ps(_mm256_cmp_ps(t, m, _CMP_EQ_OQ));
+		u32 lane = 0;
+		while (!(mask & (1u << lane))) {
+			++lane;
+		}
+		ray.tMax = nearest;
+		best = i + lane;
+	}
+
+	if (best == last) {
+		return false;
+	}
+	hit.t = ray.tMax;
+	hit.object = objects[best];
+	return true;
+}
+
+bool SphereArray::Occluded(u32 first, u32 last, const Ray& ray) const {
+	r32 dd = v3::Dot(ray.direction, ray.direction);
+	__m256 a = _mm256_set1_ps(dd);
+	__m256 invA = _mm256_set1_ps(1.0f / dd);
+	__m256 inf = _mm256_set1_ps(std::numeric_limits<r32>::infinity());
+
+	for (u32 i = first; i < last; i += 8) {
+		__m256 t = SphereRoots(*this, i, std::min(last - i, 8u), ray, a, invA);
+		if (_mm256_movemask_ps(_mm256_cmp_ps(t, inf, _CMP_LT_OQ))) {
+			return true;
+		}
+	}
+	return false;
+}
+#else
+// same roots as Sphere::Intersect, the near one unless it's in front of tMin
+bool SphereArray::Intersect(u32 first, u32 last, Ray& ray, HitRecord& hit) const {
+	r32 a = v3::Dot(ray.direction, ray.direction);
+	r32 invA = 1.0f / a;
+
+	u32 best = last;
+	for (u32 i = first; i < last; ++i) {
+		r32 ox = ray.origin.x - centerX[i];
+		r32 oy = ray.origin.y - centerY[i];
+		r32 oz = ray.origin.z - centerZ[i];
+		// half of b, the 2s and 4 cancel
+		r32 b = ox * ray.direction.x + oy * ray.direction.y + oz * ray.direction.z;
+		r32 c = ox * ox + oy * oy + oz * oz - radius2[i];
+
+		r32 delta = b * b - a * c;
+		if (delta < 0) {
+			continue;
+		}
+		r32 cd = std::sqrt(delta);
+		r32 tNear = -(b + cd) * invA;
+		r32 t = tNear > ray.tMin ? tNear : (cd - b) * invA;
+		if (t > ray.tMin && t < ray.tMax) {
+			ray.tMax = t;
+			best = i;
+		}
+	}
+
+	if (best == last) {
+		return false;
+	}
+	hit.t = ray.tMax;
+	hit.object = objects[best];
+	return true;
+}
+
+bool SphereArray::Occluded(u32 first, u32 last, const Ray& ray) const {
+	r32 a = v3::Dot(ray.direction, ray.direction);
+	r32 invA = 1.0f / a;
+
+	for (u32 i = first; i < last; ++i) {
+		r32 ox = ray.origin.x - centerX[i];
+		r32 oy = ray.origin.y - centerY[i];
+		r32 oz = ray.origin.z - centerZ[i];
+		r32 b = ox * ray.direction.x + oy * ray.direction.y + oz * ray.direction.z;
+		r32 c = ox * ox + oy * oy + oz * oz - radius2[i];
+
+		r32 delta = b * b - a * c;
+		if (delta < 0) {
+			continue;
+		}
+		r32 cd = std::sqrt(delta);
+		r32 tNear = -(b + cd) * invA;
+		r32 t = tNear > ray.tMin ? tNear : (cd - b) * invA;
+		if (t > ray.tMin && t < ray.tMax) {
+			return true;
+		}
+	}
+	return false;
+}
+#endif
+
+u32 PlaneArray::Add(Plane* plane) {
+	objects.push_back(plane);
+	pointX.push_back(0);
+	pointY.push_back(0);
+	pointZ.push_back(0);
+	normalX.push_back(0);
+	normalY.push_back(0);
+	normalZ.push_back(0);
+	Copy(Size() - 1);
+	return Size() - 1;
+}
+
+void PlaneArray::Copy(u32 slot) {
+	pointX[slot] = objects[slot]->mPosition.x;
+	pointY[slot] = objects[slot]->mPosition.y;
+	pointZ[slot] = objects[slot]->mPosition.z;
+	normalX[slot] = objects[slot]->mNormal.x;
+	normalY[slot] = objects[slot]->mNormal.y;
+	normalZ[slot] = objects[slot]->mNormal.z;
+}
+
+void PlaneArray::Update() {
+	for (u32 i = 0; i < Size(); ++i) {
+		Copy(i);
+	}
+}
+
+bool PlaneArray::Intersect(u32 first, u32 last, Ray& ray, HitRecord& hit) const {
+	u32 best = last;
+	for (u32 i = first; i < last; ++i) {
+		r32 dirDot = ray.direction.x * normalX[i] + ray.direction.y * normalY[i] + ray.direction.z * normalZ[i];
+		r32 t = (normalX[i] * (pointX[i] - ray.origin.x) + normalY[i] * (pointY[i] - ray.origin.y) +
+			normalZ[i] * (pointZ[i] - ray.origin.z)) / dirDot;
+		// parallel rays give inf or NaN, both fail
+		if (t > ray.tMin && t < ray.tMax) {
+			ray.tMax = t;
+			best = i;
+		}
+	}
+
+	if (best == last) {
+		return false;
+	}
+	hit.t = ray.tMax;
+	hit.object = objects[best];
+	return true;
+}
+
+bool PlaneArray::Occluded(u32 first, u32 last, const Ray& ray) const {
+	for (u32 i = first; i < last; ++i) {
+		r32 dirDot = ray.direction.x * normalX[i] + ray.direction.y * normalY[i] + ray.direction.z * normalZ[i];
+		r32 t = (normalX[i] * (pointX[i] - ray.origin.x) + normalY[i] * (pointY[i] - ray.origin.y) +
+			normalZ[i] * (pointZ[i] - ray.origin.z)) / dirDot;
+		if (t > ray.tMin && t < ray.tMax) {
+			return true;
+		}
+	}
+	return false;
+}
+
+u32 CubeArray::Add(Cube* cube) {
+	objects.push_back(cube);
+	minX.push_back(0);
+	minY.push_back(0);
+	minZ.push_back(0);
+	maxX.push_back(0);
+	maxY.push_back(0);
+	maxZ.push_back(0);
+	Copy(Size() - 1);
+	return Size() - 1;
+}
+
+void CubeArray::Copy(u32 slot) {
+	BoundingBox box;
+	objects[slot]->GetBoundingBox(box);
+	minX[slot] = box.min.x;
+	minY[slot] = box.min.y;
+	minZ[slot] = box.min.z;
+	maxX[slot] = box.max.x;
+	maxY[slot] = box.max.y;
+	maxZ[slot] = box.max.z;
+}
+
+void CubeArray::Update() {
+	for (u32 i = 0; i < Size(); ++i) {
+		Copy(i);
+	}
+}
+
+// entry distance like Cube::Slabs, exit ends up in front of the entry when the ray misses
+static r32 CubeEntry(const CubeArray& cubes, u32 i, const Ray& ray, r32& exit) {
+	r32 tmin = std::numeric_limits<r32>::min();
+	r32 tmax = std::numeric_limits<r32>::max();
+	if (ray.direction.x != 0.0) {
+		r32 t1 = (cubes.minX[i] - ray.origin.x) / ray.direction.x;
+		r32 t2 = (cubes.maxX[i] - ray.origin.x) / ray.direction.x;
+		tmin = std::max(tmin, std::min(t1, t2));
+		tmax = std::min(tmax, std::max(t1, t2));
+	} else if (ray.origin.x < cubes.minX[i] || ray.origin.x > cubes.maxX[i]) {
+		tmax = std::numeric_limits<r32>::lowest();
+	}
+	if (ray.direction.y != 0.0) {
+		r32 t1 = (cubes.minY[i] - ray.origin.y) / ray.direction.y;
+		r32 t2 = (cubes.maxY[i] - ray.origin.y) / ray.direction.y;
+		tmin = std::max(tmin, std::min(t1, t2));
+		tmax = std::min(tmax, std::max(t1, t2));
+	} else if (ray.origin.y < cubes.minY[i] || ray.origin.y > cubes.maxY[i]) {
+		tmax = std::numeric_limits<r32>::lowest();
+	}
+	if (ray.direction.z != 0.0) {
+		r32 t1 = (cubes.minZ[i] - ray.origin.z) / ray.direction.z;
+		r32 t2 = (cubes.maxZ[i] - ray.origin.z) / ray.direction.z;
+		tmin = std::max(tmin, std::min(t1, t2));
+		tmax = std::min(tmax, std::max(t1, t2));
+	} else if (ray.origin.z < cubes.minZ[i] || ray.origin.z > cubes.maxZ[i]) {
+		tmax = std::numeric_limits<r32>::lowest();
+	}
+	exit = tmax;
+	return tmin;
+}
+
+bool CubeArray::Intersect(u32 first, u32 last, Ray& ray, HitRecord& hit) const {
+	u32 best = last;
+	for (u32 i = first; i < last; ++i) {
+		r32 exit;
+		r32 t = CubeEntry(*this, i, ray, exit);
+		if (exit >= t && t > ray.tMin && t < ray.tMax) {
+			ray.tMax = t;
+			best = i;
+		}
+	}
+
+	if (best == last) {
+		return false;
+	}
+	hit.t = ray.tMax;
+	hit.object = objects[best];
+	return true;
+}
+
+bool CubeArray::Occluded(u32 first, u32 last, const Ray& ray) const {
+	for (u32 i = first; i < last; ++i) {
+		r32 exit;
+		r32 t = CubeEntry(*this, i, ray, exit);
+		if (exit >= t && t > ray.tMin && t < ray.tMax) {
+			return true;
+		}
+	}
+	return false;
+}
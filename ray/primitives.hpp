@@ -0,0 +1,68 @@
+#pragma once
+
+#include <vector>
+
+#include "global.hpp"
+#include "math.hpp"
+#include "ray.hpp"
+
+class Sphere;
+class Plane;
+class Cube;
+
+// the scene's spheres, planes and cubes copied into one structure of arrays per type by
+// BVH::BuildFromScene, so they get tested in plain loops instead of a virtual call each.
+// Intersect tests [first, last), pulls ray.tMax in to every hit and only writes hit when it returns true
+
+// tested 8 at a time with AVX2, runs shorter than that mask off the lanes past their end
+struct SphereArray {
+	std::vector<r32> centerX;
+	std::vector<r32> centerY;
+	std::vector<r32> centerZ;
+	std::vector<r32> radius2; // squared, the only way the test uses it
+	std::vector<Sphere*> objects;
+
+	u32 Size() const { return (u32)objects.size(); }
+	// returns the slot
+	u32 Add(Sphere* sphere);
+	// copies one object into its slot
+	void Copy(u32 slot);
+	// copies all of them again after they moved
+	void Update();
+	bool Intersect(u32 first, u32 last, Ray& ray, HitRecord& hit) const;
+	bool Occluded(u32 first, u32 last, const Ray& ray) const;
+};
+
+struct PlaneArray {
+	std::vector<r32> pointX;
+	std::vector<r32> pointY;
+	std::vector<r32> pointZ;
+	std::vector<r32> normalX;
+	std::vector<r32> normalY;
+	std::vector<r32> normalZ;
+	std::vector<Plane*> objects;
+
+	u32 Size() const { return (u32)objects.size(); }
+	u32 Add(Plane* plane);
+	void Copy(u32 slot);
+	void Update();
+	bool Intersect(u32 first, u32 last, Ray& ray, HitRecord& hit) const;
+	bool Occluded(u32 first, u32 last, const Ray& ray) const;
+};
+
+struct CubeArray {
+	std::vector<r32> minX;
+	std::vector<r32> minY;
+	std::vector<r32> minZ;
+	std::vector<r32> maxX;
+	std::vector<r32> maxY;
+	std::vector<r32> maxZ;
+	std::vector<Cube*> objects;
+
+	u32 Size() const { return (u32)objects.size(); }
+	u32 Add(Cube* cube);
+	void Copy(u32 slot);
+	void Update();
+	bool Intersect(u32 first, u32 last, Ray& ray, HitRecord& hit) const;
+	bool Occluded(u32 first, u32 last, const Ray& ray) const;
+};
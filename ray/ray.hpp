@@ -1,5 +1,8 @@
 #pragma once
 
+#include <limits>
+#include <ostream>
+
 #include "math.hpp"
 
 class Object;
@@ -7,12 +10,54 @@ class Object;
 struct Ray {
     Math::v3 origin;
     Math::v3 direction;
+    // only hits with tMin < t < tMax count, closest hit searches pull tMax in as they find hits
+    r32 tMin = 0;
+    r32 tMax = std::numeric_limits<r32>::max();
+};
+
+// what intersection hands back, just enough for Object::Hit to find the surface again
+struct HitRecord {
+    r32 t;
+    Object* object;
+    // triangle index for meshes, unused otherwise
+    u32 primitive;
 };
 
+// the shaded closest hit, built once per ray by Object::Hit
 struct RayPayload {
     Object* closestHit;
     Math::v3 normal;
     Math::v3 position;
+    // texture coordinates
+    r32 u;
+    r32 v;
     r32 closestDistance;
 };
 
+
+// counters every render thread keeps for itself and hands in once per frame,
+// so tracing never writes memory another thread reads
+struct TraceStats {
+    u64 rays = 0;
+    u64 hits = 0;
+    // bottom level traversals inside meshes and instances included
+    u64 nodesVisited = 0;
+    u64 leavesTested = 0;
+    u64 trianglesTested = 0;
+
+    void Add(const TraceStats& other) {
+        rays += other.rays;
+        hits += other.hits;
+        nodesVisited += other.nodesVisited;
+        leavesTested += other.leavesTested;
+        trianglesTested += other.trianglesTested;
+    }
+
+    void Print(std::ostream& out) const {
+        r64 perRay = rays ? 1.0 / rays : 0;
+        out << "Rays " << rays << ", hits " << hits
+            << ", per ray: nodes " << nodesVisited * perRay
+            << ", leaves " << leavesTested * perRay
+            << ", triangles " << trianglesTested * perRay << std::endl;
+    }
+};
@@ -2,9 +2,6 @@
 #include "ray.hpp"
 #include "bvh.hpp"
 
-#define _USE_MATH_DEFINES
-#include <math.h>
-
 #include "texture.hpp"
 
 using namespace Math;
@@ -13,14 +10,33 @@ void Scene::AddObject(Object* o) {
     mObjects.push_back(o);
 }
 
+void Scene::RemoveDebugObjects() {
+    for (auto& o : mDebugObjects) {
+        mObjects.erase(std::remove(mObjects.begin(), mObjects.end(), o), mObjects.end());
+        delete o;
+    }
+    mDebugObjects.clear();
+}
+
 RayPayload Scene::Miss() {
     RayPayload result;
     result.closestDistance = -1;
     return result;
 }
 
+// bounce rays ignore hits closer than this, the point they start from is only accurate up to rounding
+static constexpr r32 BounceEpsilon = 0.0001f;
+
+static constexpr int Bounces = 1;
+static const v3 SkyColor(0.7, 0.7, 0.9);
+
+Random::PCG Scene::SampleRandom(int x, int y, int width, int sample, int samplesPerPixel) const {
+    u64 pixel = ((u64)mSeed << 32) | (u32)(x + y * width);
+    return Random::PCG(Random::Hash(pixel), (u64)mIterations * samplesPerPixel + sample);
+}
+
 // maybe in some renderer class
-v3 Scene::ProcessPixel(int x, int y, int width, int height, v3 origin, v3 bias) {
+Ray Scene::CameraRay(int x, int y, int width, int height, v3 origin, v3 bias) {
     r32 aspectRatio = width / (r32)height;
 
     r32 u = ((x + 0.5f) / (r32)(width)) * aspectRatio;
@@ -47,105 +63,199 @@ v3 Scene::ProcessPixel(int x, int y, int width, int height, v3 origin, v3 bias)
     Ray r;
     r.direction = direction;
     r.origin = origin;
+    return r;
+}
 
-    v3 color;
-    v3 skyColor(0.7, 0.7, 0.9);
+bool Scene::Shade(Ray& r, const RayPayload& p, v3& color, v3& attenuation, Random::PCG& rng) {
+    v3 c = p.closestHit->mMaterial.albedo;
+    if (p.closestHit->mMaterial.hasAlbedoTexture) {
+        c = p.closestHit->mMaterial.albedoTexture->GetColor(p.u, p.v);
+    }
+#if 0
+    v3 em = p.closestHit->mMaterial.emission;
+    color += v3::Hadamard(attenuation, em);
+    
+    attenuation = v3::Hadamard(attenuation, c);
+#else
+    // only the #if 0 branch darkens attenuation, here it is still 1 and the last surface's colour wins
+    color = v3::Hadamard(attenuation, c);
+#endif
+    //color += c;
+
+    if (p.closestHit->mMaterial.hasEmission) { // don't bounce from emitters
+        return false;
+    }
 
-    r32 factor = 1;
+    v3 nextDirection = v3::Reflect(r.direction, p.normal + v3::RandUnitCircle(rng)* p.closestHit->mMaterial.roughness);
+    r.direction = nextDirection;
+    r.origin = p.position;
+    // skips the surface the ray leaves instead of pushing the origin off it
+    r.tMin = BounceEpsilon;
+    r.tMax = std::numeric_limits<r32>::max();
+    return true;
+}
+
+v3 Scene::ProcessPixel(int x, int y, int width, int height, v3 origin, v3 bias, Random::PCG& rng, TraceStats& stats) {
+    Ray r = CameraRay(x, y, width, height, origin, bias);
+
+    v3 color;
     v3 attenuation(1, 1, 1);
 
-    int bounces = 1;
     r32 iterations = 1;
-    for (int i = 0; i < bounces; ++i) {
-        RayPayload p = CastRay(r);
+    for (int i = 0; i < Bounces; ++i) {
+        RayPayload p = CastRay(r, stats);
 
         //++iterations;
         if (p.closestDistance < 0) {
-            color += v3::Hadamard(attenuation, skyColor);
+            color += v3::Hadamard(attenuation, SkyColor);
             break;
         }
 
-        v3 c = p.closestHit->mMaterial.albedo;
-        if (p.closestHit->mMaterial.hasAlbedoTexture) {
-            // sphere
-            v3 d = -p.normal;
-
-            r32 chu = 0.5f + (std::atan2(d.z, d.x) / (2 * M_PI));
-            r32 chv = 0.5f + (std::asin(d.y) / M_PI);
-
-            c = p.closestHit->mMaterial.albedoTexture->GetColor(chu, chv);
-            //
-        }
-#if 0
-        v3 em = p.closestHit->mMaterial.emission;
-        color += v3::Hadamard(attenuation, em);
-        
-        attenuation = v3::Hadamard(attenuation, c);
-#else
-         color = c;
-#endif
-        //color += c;
-
-        if (p.closestHit->mMaterial.hasEmission) { // don't bounce from emitters
+        if (!Shade(r, p, color, attenuation, rng)) {
             break;
         }
-
-        v3 nextDirection = v3::Reflect(r.direction, p.normal + v3::RandUnitCircle()* p.closestHit->mMaterial.roughness);
-        r.direction = nextDirection;
-        r.origin = p.position + p.normal * 0.000001f;
     }
     return color / iterations;
 }
-static bool b = false;
-extern std::atomic<r32> avgNodes;
-extern std::atomic<r32> avgNodesCount;
-RayPayload Scene::CastRay(Ray& ray) {
-    RayPayload closestHit;
-    closestHit.closestDistance = std::numeric_limits<float>::max();
 
-    bool hit = false;
-#if 0
-    std::vector<BVHNode*> nodes;
-    bvh->SelectHitLeafsFromRay(ray, bvh->mRoot, nodes);
+void Scene::ProcessTile(int startX, int startY, int endX, int endY, int width, int height, v3 origin, int samplesPerPixel, v3* colors, WavefrontScratch& scratch, TraceStats& stats) {
+    int tileWidth = endX - startX;
+    int pixelCount = tileWidth * (endY - startY);
 
-    avgNodes = avgNodes + nodes.size();
-    avgNodesCount = avgNodesCount + 1;
-    
-    for (auto& node : nodes) {
-        for (auto& obj : node->objectContents) {
-            RayPayload p = obj->Intersect(ray);
-            if (p.closestDistance < closestHit.closestDistance && p.closestDistance > 0) {
-                closestHit = p;
-                hit = true;
+    // generate, every sample of the tile starts with the same camera ray and random sequence ProcessPixel would use
+    std::vector<WavefrontPath>& paths = scratch.paths;
+    paths.clear();
+    paths.reserve(pixelCount * samplesPerPixel);
+    for (int y = startY; y < endY; ++y) {
+        for (int x = startX; x < endX; ++x) {
+            for (int i = 0; i < samplesPerPixel; ++i) {
+                WavefrontPath path = { Ray(), HitRecord(), v3(), v3(1, 1, 1), SampleRandom(x, y, width, i, samplesPerPixel), (u32)((x - startX) + (y - startY) * tileWidth) };
+                v3 rd = v3::RandUnitCircle(path.rng, -0.001f, 0.001f);
+                path.ray = CameraRay(x, y, width, height, origin, rd);
+                paths.push_back(path);
             }
         }
-#if 1
-        for (auto& obj : node->triangleContents) {
-            TriangleArray* tobj = dynamic_cast<TriangleArray*>(obj.first);
+    }
 
-            RayPayload p = tobj->Intersect(ray, obj.second);
+    // the queue holds the paths still tracing, the camera rays for the first wave, the bounce rays after that
+    std::vector<u32>& queue = scratch.queue;
+    queue.resize(paths.size());
+    for (u32 i = 0; i < queue.size(); ++i) {
+        queue[i] = i;
+    }
+    std::vector<u8>& found = scratch.found;
+    found.resize(paths.size());
+    std::vector<u32>& hits = scratch.hits;
+    std::vector<u32>& misses = scratch.misses;
+    std::vector<u32>& next = scratch.next;
+    hits.reserve(paths.size());
+    misses.reserve(paths.size());
+    next.reserve(paths.size());
+
+    for (int bounce = 0; bounce < Bounces && !queue.empty(); ++bounce) {
+        // extend, every ray of the wave is intersected before anything is shaded
+        for (u32 i : queue) {
+            WavefrontPath& path = paths[i];
+            found[i] = Intersect(path.ray, path.hit, stats);
+        }
 
-            if (p.closestDistance < closestHit.closestDistance && p.closestDistance > 0) {
-                closestHit = p;
-                hit = true;
+        // compact the wave into the paths that hit something and the ones that left the scene
+        hits.clear();
+        misses.clear();
+        for (u32 i : queue) {
+            if (found[i]) {
+                hits.push_back(i);
+            } else {
+                misses.push_back(i);
             }
         }
-#endif
+
+        // misses finish here with the sky
+        for (u32 i : misses) {
+            WavefrontPath& path = paths[i];
+            path.color += v3::Hadamard(path.attenuation, SkyColor);
+        }
+
+        // grouped by object so every material and texture is shaded in one run
+        std::sort(hits.begin(), hits.end(), [&](u32 a, u32 b) { return paths[a].hit.object < paths[b].hit.object; });
+
+        // shade, the bounce rays it generates are gathered into the next wave
+        next.clear();
+        for (u32 i : hits) {
+            WavefrontPath& path = paths[i];
+            RayPayload p = path.hit.object->Hit(path.ray, path.hit);
+            if (Shade(path.ray, p, path.color, path.attenuation, path.rng)) {
+                next.push_back(i);
+            }
+        }
+        queue.swap(next);
+    }
+
+    // summed before the divide, the same rounding as TraceMain's sample loop
+    std::fill(colors, colors + pixelCount, v3());
+    for (const WavefrontPath& path : paths) {
+        colors[path.pixel] += path.color;
+    }
+    for (int i = 0; i < pixelCount; ++i) {
+        colors[i] = colors[i] / samplesPerPixel;
+    }
+}
+
+bool Scene::Intersect(Ray& ray, HitRecord& closestHit, TraceStats& stats) {
+    ++stats.rays;
+
+    bool hit = false;
+#if 1
+    // every hit pulls in ray.tMax, so whatever comes back after it is closer
+    if (bvh->mPlanes.Intersect(0, bvh->mPlanes.Size(), ray, closestHit)) {
+        hit = true;
+    }
+    for (auto& obj : bvh->mUnboundedObjects) {
+        if (obj->Intersect(ray, closestHit)) {
+            ray.tMax = closestHit.t;
+            hit = true;
+        }
+    }
+
+    if (bvh->Intersect(ray, closestHit, stats)) {
+        hit = true;
     }
 #else
     for (auto& obj : mObjects) {
-        RayPayload p = obj->Intersect(ray);
-        if (p.closestDistance < closestHit.closestDistance && p.closestDistance > 0) {
-            closestHit = p;
+        if (obj->Intersect(ray, closestHit)) {
+            ray.tMax = closestHit.t;
             hit = true;
         }
     }
 #endif
 
+    if (hit) {
+        ++stats.hits;
+    }
+    return hit;
+}
+
+RayPayload Scene::CastRay(Ray& ray, TraceStats& stats) {
+    HitRecord closestHit;
+    if (!Intersect(ray, closestHit, stats)) {
+        return Miss();
+    }
+    // shading happens once, for the hit that won
+    return closestHit.object->Hit(ray, closestHit);
+}
 
+bool Scene::Occluded(const Ray& ray, TraceStats& stats) {
+    ++stats.rays;
+    bool hit = bvh->mPlanes.Occluded(0, bvh->mPlanes.Size(), ray);
+    for (u32 i = 0; !hit && i < bvh->mUnboundedObjects.size(); ++i) {
+        hit = bvh->mUnboundedObjects[i]->Occluded(ray);
+    }
     if (!hit) {
-        closestHit.closestDistance = -1;
+        hit = bvh->Occluded(ray, stats);
     }
-    return closestHit;
-}
 
+    if (hit) {
+        ++stats.hits;
+    }
+    return hit;
+}
@@ -7,19 +7,63 @@
 #include "global.hpp"
 #include "math.hpp"
 #include "object.hpp"
+#include "bvh.hpp"
+
+// one sample's path through the wavefront stages
+struct WavefrontPath {
+    Ray ray;
+    HitRecord hit;
+    Math::v3 color;
+    Math::v3 attenuation;
+    Random::PCG rng;
+    u32 pixel;
+};
+
+// ProcessTile's buffers, owned by the render thread and reused for every tile so they're only allocated
+// while they grow to the first tile's size
+struct WavefrontScratch {
+    std::vector<WavefrontPath> paths;
+    std::vector<u32> queue;
+    std::vector<u8> found;
+    std::vector<u32> hits;
+    std::vector<u32> misses;
+    std::vector<u32> next;
+};
 
-class BVH;
 class Scene {
 public:
     BVH* bvh;
+    BVHBuildSettings mBVHSettings;
     std::vector<Object*> mObjects;
+    // also in mObjects, added by the BVH build and dropped again when it runs next
+    std::vector<Sphere*> mDebugObjects;
     Math::v3* mPaths;
     int mIterations;
+    // mixed into every pixel's random sequence, the same seed renders the same image
+    u32 mSeed;
+    // render threads use ProcessTile instead of ProcessPixel, for A/B comparisons, the image stays the same
+    bool mWavefront;
 
     void AddObject(Object* o);
+    void RemoveDebugObjects();
     
     static RayPayload Miss();
     
-    Math::v3 ProcessPixel(int x, int y, int width, int height, Math::v3 origin, Math::v3 bias);
-    RayPayload CastRay(Ray& ray);
+    // one sample's own sequence, from the seed, pixel and frame, so the image doesn't depend on the integrator or the tile schedule
+    Random::PCG SampleRandom(int x, int y, int width, int sample, int samplesPerPixel) const;
+    Ray CameraRay(int x, int y, int width, int height, Math::v3 origin, Math::v3 bias);
+    // the surface color of a hit, false when the path ends there, otherwise r becomes the bounce ray
+    bool Shade(Ray& r, const RayPayload& p, Math::v3& color, Math::v3& attenuation, Random::PCG& rng);
+    // megakernel, follows one path to the end. stats belongs to the calling thread, like rng
+    Math::v3 ProcessPixel(int x, int y, int width, int height, Math::v3 origin, Math::v3 bias, Random::PCG& rng, TraceStats& stats);
+    // wavefront, starts every sample of the tile at once, then each bounce intersects the whole wave,
+    // sorts the hits by object and shades them, the ones that bounce on form the next wave.
+    // colors gets one averaged color per pixel, row by row over the tile. scratch belongs to the calling thread, like stats
+    void ProcessTile(int startX, int startY, int endX, int endY, int width, int height, Math::v3 origin, int samplesPerPixel, Math::v3* colors, WavefrontScratch& scratch, TraceStats& stats);
+    // closest hit inside the ray's interval without shading it, ray.tMax ends up at the hit
+    bool Intersect(Ray& ray, HitRecord& closestHit, TraceStats& stats);
+    // closest hit inside the ray's interval, ray.tMax ends up at the hit
+    RayPayload CastRay(Ray& ray, TraceStats& stats);
+    // shadow and occlusion rays, true once anything is hit inside the ray's interval
+    bool Occluded(const Ray& ray, TraceStats& stats);
 };
@@ -8,39 +8,66 @@
 using namespace Math;
 #define FLOAT2RGB(x) std::round((x) * 255);
 
-std::atomic<bool> ThreadManager::mEndFlag = false;
-std::vector<std::atomic<bool>*> ThreadManager::mStartFlags;
-std::vector<std::atomic<bool>*> ThreadManager::mDoneFlags;
+std::mutex ThreadManager::mMutex;
+std::condition_variable ThreadManager::mWorkReady;
+std::condition_variable ThreadManager::mWorkDone;
+std::vector<std::thread> ThreadManager::mThreads;
+u64 ThreadManager::mGeneration = 0;
+u32 ThreadManager::mBusyCount = 0;
+bool ThreadManager::mEndFlag = false;
+std::chrono::steady_clock::time_point ThreadManager::mResumeTime;
+u64 ThreadManager::mWakeups = 0;
+r64 ThreadManager::mWakeupTotal = 0;
+r64 ThreadManager::mWakeupMax = 0;
+TraceStats ThreadManager::mFrameStats;
+TraceStats ThreadManager::mTotalStats;
+std::vector<ThreadManager::TileQueue> ThreadManager::mQueues;
+u32 ThreadManager::mTileCount = 0;
 
 void TracerThread::TraceMain(ThreadContext context) {
-	// switch to windows API
-	std::atomic<bool>* start = ThreadManager::GetStartFlag(context.id);
-	while (!ThreadManager::ShouldStop()) {
-		{
-			if (!*start) {
-				//std::this_thread::sleep_for(std::chrono::milliseconds(10));
-				continue;
-			}
-
+	// one tile's averaged samples, from either integrator
+	std::vector<v3> colors(ThreadManager::TileSize * ThreadManager::TileSize);
+	WavefrontScratch scratch;
+	u64 generation = 0;
+	while (ThreadManager::WaitForWork(generation)) {
+		TraceStats stats;
+		u32 tile;
+		while (ThreadManager::NextTile(context.id, tile)) {
 			u8* data = context.imageData;
-			u32 startY = context.startY;
-			u32 endY = context.endY;
 			u32 width = context.width;
 			u32 height = context.height;
 			Scene* scene = context.scene;
+
+			// tiles are numbered row by row, the last ones in a row or column get cut at the image edge
+			u32 tilesX = (width + ThreadManager::TileSize - 1) / ThreadManager::TileSize;
+			u32 startX = tile % tilesX * ThreadManager::TileSize;
+			u32 startY = tile / tilesX * ThreadManager::TileSize;
+			u32 endX = std::min(startX + ThreadManager::TileSize, width);
+			u32 endY = std::min(startY + ThreadManager::TileSize, height);
 			
 			v3 origin(0, 0, 0);
 
 			int samplesPerPixel = 1;
-			for (int y = startY; y < endY; ++y) {
-				for (int x = 0; x < width; ++x) {
-					v3 color;
-					v3 sampleColor;
-					for (int i = 0; i < samplesPerPixel; ++i) {
-						v3 rd = v3::RandUnitCircle(-0.001f, 0.001f);
-						sampleColor += scene->ProcessPixel(x, y, width, height, origin, rd);
+			u32 tileWidth = endX - startX;
+			if (scene->mWavefront) {
+				scene->ProcessTile(startX, startY, endX, endY, width, height, origin, samplesPerPixel, colors.data(), scratch, stats);
+			} else {
+				for (int y = startY; y < endY; ++y) {
+					for (int x = startX; x < endX; ++x) {
+						v3 sampleColor;
+						for (int i = 0; i < samplesPerPixel; ++i) {
+							Random::PCG rng = scene->SampleRandom(x, y, width, i, samplesPerPixel);
+							v3 rd = v3::RandUnitCircle(rng, -0.001f, 0.001f);
+							sampleColor += scene->ProcessPixel(x, y, width, height, origin, rd, rng, stats);
+						}
+						colors[(x - startX) + (y - startY) * tileWidth] = sampleColor / samplesPerPixel;
 					}
-					color = sampleColor / samplesPerPixel;
+				}
+			}
+
+			for (int y = startY; y < endY; ++y) {
+				for (int x = startX; x < endX; ++x) {
+					v3 color = colors[(x - startX) + (y - startY) * tileWidth];
 
 					scene->mPaths[x + y * width] += color;
 
@@ -62,56 +89,116 @@ void TracerThread::TraceMain(ThreadContext context) {
 #endif
 				}
 			}
-
-			ThreadManager::SetDoneFlag(context.id);
-			*start = false;
 		}
+
+		ThreadManager::FinishWork(stats);
 	}
 }
 
-void ThreadManager::SetDoneFlag(int i) {
-	*mDoneFlags[i] = true;
+bool ThreadManager::WaitForWork(u64& generation) {
+	std::unique_lock<std::mutex> lock(mMutex);
+	mWorkReady.wait(lock, [&]() { return mEndFlag || mGeneration != generation; });
+	if (mEndFlag) {
+		return false;
+	}
+
+	generation = mGeneration;
+	r64 latency = std::chrono::duration<r64, std::micro>(std::chrono::steady_clock::now() - mResumeTime).count();
+	mWakeupTotal += latency;
+	mWakeupMax = std::max(mWakeupMax, latency);
+	++mWakeups;
+	return true;
 }
 
-void ThreadManager::StartThread(int i) {
-	*mStartFlags[i] = true;
+bool ThreadManager::NextTile(u32 id, u32& tile) {
+	{
+		TileQueue& own = mQueues[id];
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if (!own.tiles.empty()) {
+			tile = own.tiles.front();
+			own.tiles.pop_front();
+			return true;
+		}
+	}
+
+	// starting at the next worker spreads the thieves over the queues
+	for (u32 i = 1; i < mQueues.size(); ++i) {
+		TileQueue& victim = mQueues[(id + i) % mQueues.size()];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (!victim.tiles.empty()) {
+			tile = victim.tiles.back();
+			victim.tiles.pop_back();
+			return true;
+		}
+	}
+	return false;
 }
 
-std::atomic<bool>* ThreadManager::GetStartFlag(int i) {
-	return mStartFlags[i];
+void ThreadManager::FinishWork(const TraceStats& stats) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	mFrameStats.Add(stats);
+	mTotalStats.Add(stats);
+	if (--mBusyCount == 0) {
+		mWorkDone.notify_one();
+	}
 }
 
 void ThreadManager::WaitForThreads() {
-	while (true) {
-		bool done = true;
-		for (auto& f : mDoneFlags) {
-			done = done && *f;
-		}
+	std::unique_lock<std::mutex> lock(mMutex);
+	mWorkDone.wait(lock, []() { return mBusyCount == 0; });
+}
 
-		if (done) {
-			break;
-		} else {
-			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+void ThreadManager::ResumeThreads() {
+	// an even share of neighbouring tiles each, stealing evens out the rest
+	u32 queueCount = (u32)mQueues.size();
+	for (u32 i = 0; i < queueCount; ++i) {
+		std::lock_guard<std::mutex> lock(mQueues[i].mutex);
+		for (u32 tile = mTileCount * i / queueCount; tile < mTileCount * (i + 1) / queueCount; ++tile) {
+			mQueues[i].tiles.push_back(tile);
 		}
 	}
+
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		++mGeneration;
+		mBusyCount = (u32)mThreads.size();
+		mFrameStats = TraceStats();
+		mResumeTime = std::chrono::steady_clock::now();
+	}
+	mWorkReady.notify_all();
 }
 
-void ThreadManager::ResumeThreads() {
-	for (auto& f : mDoneFlags) {
-		*f = false;
+void ThreadManager::StopThreads() {
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mEndFlag = true;
 	}
+	mWorkReady.notify_all();
 
-	for (auto& f : mStartFlags) {
-		*f = true;
+	for (auto& t : mThreads) {
+		if (t.joinable()) {
+			t.join();
+		}
 	}
+	mThreads.clear();
 }
 
-bool ThreadManager::ShouldStop() {
-	return mEndFlag;
+TraceStats ThreadManager::FrameStats() {
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mFrameStats;
 }
 
-void ThreadManager::StopThreads() {
-	mEndFlag = true;
+TraceStats ThreadManager::TotalStats() {
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mTotalStats;
+}
+
+void ThreadManager::PrintWakeupLatency() {
+	std::lock_guard<std::mutex> lock(mMutex);
+	if (!mWakeups) {
+		return;
+	}
+	std::cout << "Worker wakeup took " << mWakeupTotal / mWakeups << "[us] on average, " << mWakeupMax << "[us] at most over " << mWakeups << " wakeups" << std::endl;
 }
 
 void ThreadManager::CreateThreadPool(const std::vector<ThreadContext>& contextes) {
@@ -120,11 +207,14 @@ void ThreadManager::CreateThreadPool(const std::vector<ThreadContext>& contextes
 		std::cout << "INFO not using the full amount of cores" << std::endl;
 	}
 	threadCount = contextes.size();
+	mEndFlag = false;
+	if (threadCount) {
+		u32 tilesX = (contextes[0].width + TileSize - 1) / TileSize;
+		u32 tilesY = (contextes[0].height + TileSize - 1) / TileSize;
+		mTileCount = tilesX * tilesY;
+	}
+	mQueues = std::vector<TileQueue>(threadCount);
 	for (int i = 0; i < threadCount; ++i) {
-		std::thread* t = new std::thread(TracerThread::TraceMain, contextes[i]);
-
-		mStartFlags.push_back(new std::atomic<bool>(false));
-		mDoneFlags.push_back(new std::atomic<bool>(false));
-		mEndFlag = false;
+		mThreads.emplace_back(TracerThread::TraceMain, contextes[i]);
 	}
 }
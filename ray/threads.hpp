@@ -1,18 +1,20 @@
 #pragma once
 
 #include "global.hpp"
+#include "ray.hpp"
 
 #include <thread>
 #include <vector>
 #include <mutex>
+#include <deque>
+#include <condition_variable>
+#include <chrono>
 
 class Scene;
 
 struct ThreadContext {
 	u32 id;
 
-	s32 startY;
-	s32 endY;
 	s32 width;
 	s32 height;
 	u8* imageData;
@@ -20,24 +22,62 @@ struct ThreadContext {
 	Scene* scene;
 };
 
+// workers sleep on a condition variable between passes instead of spinning on a flag.
+// Every ResumeThreads starts a new generation and splits the image into TileSize square tiles,
+// workers render tiles until none are left in their own queue or anyone else's
 class ThreadManager {
 private:
-	static std::vector<std::atomic<bool>*> mStartFlags;
-	static std::vector<std::atomic<bool>*> mDoneFlags;
-	static std::atomic<bool> mEndFlag;
+	// guards everything down to the tile queues
+	static std::mutex mMutex;
+	static std::condition_variable mWorkReady;
+	static std::condition_variable mWorkDone;
+	static std::vector<std::thread> mThreads;
+	static u64 mGeneration;
+	static u32 mBusyCount; // workers that haven't finished the current generation
+	static bool mEndFlag;
+
+	// from ResumeThreads to a worker leaving its wait, in microseconds
+	static std::chrono::steady_clock::time_point mResumeTime;
+	static u64 mWakeups;
+	static r64 mWakeupTotal;
+	static r64 mWakeupMax;
+
+	// every worker's TraceStats summed as it finishes a pass
+	static TraceStats mFrameStats;
+	static TraceStats mTotalStats;
+
+	// one per worker, each with its own lock. The owner takes tiles from the front,
+	// workers that ran out steal from the back
+	struct TileQueue {
+		std::mutex mutex;
+		std::deque<u32> tiles;
+	};
+	static std::vector<TileQueue> mQueues;
+	static u32 mTileCount;
 
 public:
+	static constexpr u32 TileSize = 32;
+
 	ThreadManager() = delete;
 	ThreadManager(const ThreadManager& other) = delete;
 
 	static void CreateThreadPool(const std::vector<ThreadContext>& contextes);
+	// wakes every worker for one more pass over the image
 	static void ResumeThreads();
+	// wakes the idle workers so they return and joins them, safe to call more than once
 	static void StopThreads();
-	static bool ShouldStop();
+	// blocks until every worker finished the pass the last ResumeThreads started
 	static void WaitForThreads();
-	static void StartThread(int i);
-	static void SetDoneFlag(int i);
-	static std::atomic<bool>* GetStartFlag(int i);
+	// worker side, blocks until a generation newer than the one passed in starts, false once the pool stops
+	static bool WaitForWork(u64& generation);
+	// the next tile of this pass for worker id, its own first, false once every queue is empty
+	static bool NextTile(u32 id, u32& tile);
+	// hands in the worker's counters for this pass
+	static void FinishWork(const TraceStats& stats);
+	// the last finished pass, and every pass since the pool was created
+	static TraceStats FrameStats();
+	static TraceStats TotalStats();
+	static void PrintWakeupLatency();
 };
 
 class TracerThread {